@@ -1,13 +1,15 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
-// in memory reduces the number of disk reads and also provides
-// a synchronization point for disk blocks used by multiple processes.
+// The buffer cache is a hash table of buf structures holding
+// cached copies of disk block contents, with a lock per
+// bucket.  Caching disk blocks in memory reduces the number
+// of disk reads and also provides a synchronization point
+// for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bdirty to have it written later.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -19,73 +21,316 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET 13
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+// Buffers beyond the NBUF built-in ones are carved out of
+// whole pages as bget() needs them, up to 1/BCACHEFRAC of
+// physical memory. bshrink() gives pages whose buffers are
+// all idle back when kalloc() runs out.
+#define BPERPAGE 3
+
+// A dirty buffer is written back by bflush(), sorted by
+// block number, FLUSHBATCH at a time.
+#define FLUSHBATCH 64
+
+struct bpage {
+  struct bpage *next;
+  int idle;  // used by bshrink()
+  struct buf buf[BPERPAGE];
+};
+
 struct {
-  struct spinlock lock;
   struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // Each buffer is on the list of one bucket, through next;
+  // once it holds a block, the bucket its block hashes to.
+  // bucket[i] protects that list and the dev, blockno,
+  // refcnt and lastuse fields of the buffers on it.
+  struct spinlock bucket[NBUCKET];
+  struct buf *head[NBUCKET];
+
+  // Held while moving a buffer between buckets, or adding
+  // or removing pages. A process holds at most one bucket
+  // lock unless it holds this too.
+  struct spinlock steal;
+  struct bpage *pages;
+  int npages;
+  int maxpages;
+
+  // Dirty buffers, a list per device through dnext and
+  // dprev. Each holds a reference to its buffer, so that
+  // the block stays cached until it has been written.
+  // dirtylock protects the lists and the dirty fields; it
+  // may be held while taking a bucket lock.
+  struct spinlock dirtylock;
+  struct buf *dirty[NDEV];
+  int ndirty;
+
+  int hit;
+  int miss;
+  int evict;
+  int nflush;
+  int nprefetch;
 } bcache;
 
+static void bunref(struct buf*);
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
-  initlock(&bcache.lock, "bcache");
+  if(sizeof(struct bpage) > PGSIZE)
+    panic("binit: bpage");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  initlock(&bcache.steal, "bcache");
+  initlock(&bcache.dirtylock, "bcache.dirty");
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i], "bcache.bucket");
+  bcache.maxpages = (PHYSTOP - KERNBASE) / PGSIZE / BCACHEFRAC;
+
+  // Start with every buffer in bucket 0; bget() spreads them.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->next = bcache.head[0];
+    bcache.head[0] = b;
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf*
-bget(uint dev, uint blockno)
+// Add a page of free buffers to bucket id, unless the cache
+// is at its limit. Called with no bcache locks held, since
+// kalloc() may call bshrink().
+static void
+bgrow(int id)
 {
+  struct bpage *pg;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  if((pg = kalloc()) == 0)
+    return;
+  memset(pg, 0, PGSIZE);
+  for(b = pg->buf; b < &pg->buf[BPERPAGE]; b++)
+    initsleeplock(&b->lock, "buffer");
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  acquire(&bcache.steal);
+  if(bcache.npages >= bcache.maxpages){
+    release(&bcache.steal);
+    for(b = pg->buf; b < &pg->buf[BPERPAGE]; b++)
+      freelock(&b->lock.lk);
+    kfree(pg);
+    return;
+  }
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  bcache.npages++;
+  acquire(&bcache.bucket[id]);
+  for(b = pg->buf; b < &pg->buf[BPERPAGE]; b++){
+    b->next = bcache.head[id];
+    bcache.head[id] = b;
+  }
+  release(&bcache.bucket[id]);
+  release(&bcache.steal);
+}
+
+// Free the pages whose buffers are all idle. kalloc() calls
+// this when memory runs out.
+// Returns the number of pages freed.
+int
+bshrink(void)
+{
+  struct bpage *pg, **pp, *freed = 0;
+  struct buf *b, **bp;
+  int i, n = 0;
+
+  acquire(&bcache.steal);
+  for(i = 0; i < NBUCKET; i++)
+    acquire(&bcache.bucket[i]);
+
+  for(pg = bcache.pages; pg; pg = pg->next){
+    pg->idle = 1;
+    for(b = pg->buf; b < &pg->buf[BPERPAGE]; b++)
+      if(b->refcnt > 0)
+        pg->idle = 0;
+  }
+  for(i = 0; i < NBUCKET; i++){
+    for(bp = &bcache.head[i]; (b = *bp) != 0; ){
+      if((b < bcache.buf || b >= bcache.buf+NBUF) &&
+         ((struct bpage*)PGROUNDDOWN((uint64)b))->idle)
+        *bp = b->next;
+      else
+        bp = &b->next;
+    }
+  }
+  for(pp = &bcache.pages; (pg = *pp) != 0; ){
+    if(pg->idle){
+      *pp = pg->next;
+      pg->next = freed;
+      freed = pg;
+      bcache.npages--;
+    } else {
+      pp = &pg->next;
+    }
+  }
+
+  for(i = NBUCKET-1; i >= 0; i--)
+    release(&bcache.bucket[i]);
+  release(&bcache.steal);
+
+  while((pg = freed) != 0){
+    freed = pg->next;
+    for(b = pg->buf; b < &pg->buf[BPERPAGE]; b++)
+      freelock(&b->lock.lk);
+    kfree(pg);
+    n++;
+  }
+  return n;
+}
+
+// Return the least recently used free buffer in bucket i,
+// or 0. Caller must hold bcache.bucket[i].
+static struct buf*
+lrufree(int i)
+{
+  struct buf *b, *lru = 0;
+
+  for(b = bcache.head[i]; b; b = b->next){
+    if(b->refcnt == 0 && (lru == 0 || b->lastuse < lru->lastuse))
+      lru = b;
+  }
+  return lru;
+}
+
+// Look for the block in bucket i, and take a reference to
+// it if it is there. Caller must hold bcache.bucket[i].
+static struct buf*
+lookup(int i, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.head[i]; b; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// For read-ahead (ra set), return 0 instead if the block
+// is cached already or there is no buffer to spare; else
+// the buffer is new, and the caller must start its read.
+static struct buf*
+bget(uint dev, uint blockno, int ra)
+{
+  struct buf *b, **pp;
+  int id = BHASH(dev, blockno);
+  int i;
+
+ again:
+  acquire(&bcache.bucket[id]);
+
+  // Is the block already cached?
+  if((b = lookup(id, dev, blockno)) != 0){
+    if(!ra)
+      __sync_fetch_and_add(&bcache.hit, 1);
+    goto found;
+  }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  __sync_fetch_and_add(&bcache.miss, 1);
+
+  // Grow the cache rather than evict a block, if it may.
+  if(bcache.npages < bcache.maxpages){
+    release(&bcache.bucket[id]);
+    bgrow(id);
+    acquire(&bcache.bucket[id]);
+    if((b = lookup(id, dev, blockno)) != 0)
+      goto found;
+  }
+
+  // Recycle the least recently used unused buffer of the
+  // same bucket, if there is one.
+  if((b = lrufree(id)) != 0)
+    goto recycle;
+
+  // Otherwise take one from another bucket. Drop our bucket
+  // lock first so as not to wait for another bucket while
+  // holding it; then check again, since another process
+  // may have cached the block in the meantime.
+  release(&bcache.bucket[id]);
+  acquire(&bcache.steal);
+  acquire(&bcache.bucket[id]);
+  if((b = lookup(id, dev, blockno)) != 0){
+    release(&bcache.steal);
+    goto found;
+  }
+  if((b = lrufree(id)) == 0){
+    for(i = (id + 1) % NBUCKET; i != id; i = (i + 1) % NBUCKET){
+      acquire(&bcache.bucket[i]);
+      if((b = lrufree(i)) != 0){
+        for(pp = &bcache.head[i]; *pp != b; pp = &(*pp)->next)
+          ;
+        *pp = b->next;
+        b->next = bcache.head[id];
+        bcache.head[id] = b;
+        release(&bcache.bucket[i]);
+        break;
+      }
+      release(&bcache.bucket[i]);
+    }
+  }
+  release(&bcache.steal);
+  if(b == 0){
+    release(&bcache.bucket[id]);
+    if(ra)
+      return 0;
+    // dirty buffers cannot be recycled until written. Only a
+    // checkpoint makes them, and it writes them at once;
+    // wait for that rather than write them here, where the
+    // caller may hold the locks of other buffers.
+    acquire(&bcache.dirtylock);
+    if(bcache.ndirty > 0){
+      sleep(&bcache.ndirty, &bcache.dirtylock);
+      release(&bcache.dirtylock);
+      goto again;
     }
+    release(&bcache.dirtylock);
+    panic("bget: no buffers");
   }
-  panic("bget: no buffers");
+
+ recycle:
+  if(b->valid)
+    __sync_fetch_and_add(&bcache.evict, 1);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  // b was unreferenced, so its lock is free and this does not
+  // sleep; take it before another process can find b, since
+  // bprefetch() is about to read into it.
+  acquiresleep(&b->lock);
+  release(&bcache.bucket[id]);
+  return b;
+
+ found:
+  if(ra){
+    b->refcnt--;
+    release(&bcache.bucket[id]);
+    return 0;
+  }
+  release(&bcache.bucket[id]);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,7 +339,7 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -102,6 +347,86 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Write the n locked buffers in bs to disk, with all of the
+// writes in flight at once.
+void
+bwritev(struct buf **bs, int n)
+{
+  int i, j;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+
+  // one request for each run of consecutive blocks.
+  bplug();
+  for(i = 0; i < n; i = j){
+    for(j = i + 1; j < n && j - i < NVEC; j++)
+      if(bs[j]->dev != bs[i]->dev || bs[j]->blockno != bs[j-1]->blockno + 1)
+        break;
+    virtio_disk_submitv(bs + i, j - i, 1);
+  }
+  bunplug();
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
+// Requests started between bplug() and bunplug(), e.g. by
+// bprefetch(), reach the disk as one batch. Do not wait for
+// a buffer while plugged: its owner may be waiting for one
+// of the held-back requests.
+void
+bplug(void)
+{
+  virtio_disk_plug();
+}
+
+void
+bunplug(void)
+{
+  virtio_disk_unplug();
+}
+
+// Called by virtio_disk_intr() when a read started by
+// bprefetch() completes. Give up the buffer on behalf of
+// the process that started the read, which has moved on.
+static void
+bdone(struct buf *b)
+{
+  b->iodone = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bunref(b);
+}
+
+// Start reading the n blocks listed in blocks into the
+// cache, skipping those that are there already, but do not
+// wait for them. Runs of consecutive blocks are read with
+// one request each. A buffer stays locked until its read
+// completes, so bread() of the block waits for it as usual.
+void
+bprefetch(uint dev, uint *blocks, int n)
+{
+  struct buf *b, *run[NVEC];
+  int i, m = 0;
+
+  bplug();
+  for(i = 0; i < n; i++){
+    if(m > 0 && (m == NVEC || blocks[i] != run[m-1]->blockno + 1)){
+      virtio_disk_submitv(run, m, 0);
+      m = 0;
+    }
+    if((b = bget(dev, blocks[i], 1)) == 0)
+      continue;
+    b->iodone = bdone;
+    run[m++] = b;
+    __sync_fetch_and_add(&bcache.nprefetch, 1);
+  }
+  if(m > 0)
+    virtio_disk_submitv(run, m, 0);
+  bunplug();
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,8 +436,111 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Have the locked buffer b written to disk by the next
+// bflush() of its device. b stays in the cache until then.
+void
+bdirty(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bdirty");
+
+  acquire(&bcache.dirtylock);
+  if(b->dirty){
+    release(&bcache.dirtylock);
+    return;
+  }
+  if(b->dev >= NDEV)
+    panic("bdirty: dev");
+  b->dirty = 1;
+  b->dprev = 0;
+  b->dnext = bcache.dirty[b->dev];
+  if(b->dnext)
+    b->dnext->dprev = b;
+  bcache.dirty[b->dev] = b;
+  bcache.ndirty++;
+  release(&bcache.dirtylock);
+
+  bpin(b);  // the dirty list's reference
+}
+
+// Write the dirty buffers of dev in order of block number,
+// so that runs of consecutive blocks go to the disk as
+// single requests.
+void
+bflush(uint dev)
+{
+  struct buf *bs[FLUSHBATCH], *b;
+  int i, j, n;
+
+  for(;;){
+    // pick the FLUSHBATCH lowest-numbered ones.
+    acquire(&bcache.dirtylock);
+    n = 0;
+    for(b = bcache.dirty[dev]; b; b = b->dnext){
+      if(n == FLUSHBATCH && b->blockno >= bs[n-1]->blockno)
+        continue;
+      if(n < FLUSHBATCH)
+        n++;
+      for(i = n-1; i > 0 && bs[i-1]->blockno > b->blockno; i--)
+        bs[i] = bs[i-1];
+      bs[i] = b;
+    }
+    for(i = 0; i < n; i++)
+      bpin(bs[i]);  // ours, while we wait for the lock
+    release(&bcache.dirtylock);
+    if(n == 0)
+      return;
+
+    // another bflush() may have written some meanwhile.
+    for(i = j = 0; i < n; i++){
+      acquiresleep(&bs[i]->lock);
+      if(bs[i]->dirty){
+        bs[j++] = bs[i];
+      } else {
+        releasesleep(&bs[i]->lock);
+        bunpin(bs[i]);
+      }
+    }
+    bwritev(bs, j);
+
+    acquire(&bcache.dirtylock);
+    for(i = 0; i < j; i++){
+      b = bs[i];
+      b->dirty = 0;
+      if(b->dprev)
+        b->dprev->dnext = b->dnext;
+      else
+        bcache.dirty[dev] = b->dnext;
+      if(b->dnext)
+        b->dnext->dprev = b->dprev;
+    }
+    release(&bcache.dirtylock);
+    for(i = 0; i < j; i++){
+      bunpin(bs[i]);  // the dirty list's reference
+      brelse(bs[i]);
+    }
+    // only now can bget() recycle them.
+    acquire(&bcache.dirtylock);
+    bcache.ndirty -= j;
+    bcache.nflush += j;
+    wakeup(&bcache.ndirty);
+    release(&bcache.dirtylock);
+  }
+}
+
+// bflush() every device.
+void
+bflushall(void)
+{
+  uint dev;
+
+  for(dev = 0; dev < NDEV; dev++)
+    if(bcache.dirty[dev])
+      bflush(dev);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record when it was last used, for bget()'s LRU choice.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +548,59 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bunref(b);
+}
+
+// Drop a reference to b.
+static void
+bunref(struct buf *b)
+{
+  int id = BHASH(b->dev, b->blockno);
 
-  acquire(&bcache.lock);
+  acquire(&bcache.bucket[id]);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[id]);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int id = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[id]);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[id]);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int id = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[id]);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucket[id]);
 }
 
+// How many blocks the log may keep pinned (see begin_op()):
+// the buffers the cache has now beyond the NBUF built-in
+// ones, which stay for reads and the log's own writes. Pages
+// for more buffers may not be there when they are needed.
+int
+bpinmax(void)
+{
+  int n = bcache.npages * BPERPAGE;
 
+  return n < MAXOPBLOCKS ? MAXOPBLOCKS : n;
+}
+
+int
+statsbcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- bcache: %d buffers, %d hits, %d misses, %d evictions, "
+                  "%d prefetched, %d dirty, %d written back\n",
+                  NBUF + bcache.npages*BPERPAGE, bcache.hit, bcache.miss, bcache.evict,
+                  bcache.nprefetch, bcache.ndirty, bcache.nflush);
+}
@@ -3,10 +3,13 @@ struct buf {
   int disk;    // does disk "own" buf?
   uint dev;
   uint blockno;
+  void (*iodone)(struct buf*); // if set, called when the disk is done
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint lastuse;     // ticks when refcnt last dropped to 0
+  struct buf *next; // hash bucket list
+  int dirty;        // newer than the disk; see bdirty()
+  struct buf *dnext, *dprev; // its device's dirty list
   uchar data[BSIZE];
 };
 
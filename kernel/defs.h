@@ -4,18 +4,30 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct seg;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bdirty(struct buf*);
+void            bflush(uint);
+void            bflushall(void);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bpinmax(void);
+void            bprefetch(uint, uint*, int);
+void            bwritev(struct buf**, int);
+void            bplug(void);
+void            bunplug(void);
+int             bshrink(void);
+int             statsbcache(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +36,13 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             loadpage(struct proc*, struct seg*, uint64);
+struct inode*   exedup(struct inode*);
+void            exeput(struct inode*);
+void            textinit(void);
+void            textinval(struct inode*);
+int             textreclaim(void);
+int             statstext(char*, int);
 
 // file.c
 struct file*    filealloc(void);
@@ -32,13 +51,15 @@ struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             filegetdents(struct file*, uint64, int n);
 int             filewrite(struct file*, uint64, int n);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+void            dcacheremove(struct inode*, char*);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
@@ -50,9 +71,13 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, uint, uint);
+int             readdirx(struct inode*, uint64, uint*, int);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             statsdcache(char*, int);
+int             statsitable(char*, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -63,12 +88,27 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+int             krefs(void *);
+int             statskmem(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_sync(void);
+int             statslog(char*, int);
+
+// mmap.c
+struct vma*     findvma(struct proc*, uint64);
+uint64          mmapbase(struct proc*);
+uint64          mmap(uint64, uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+void            mmapexit(struct proc*);
+void            mmapinit(void);
+int             mmapfork(struct proc*, struct proc*);
+int             vmafault(struct proc*, struct vma*, uint64, int);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -86,6 +126,7 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+void            kthread(char*, void (*)(void));
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -117,6 +158,14 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+void            freelock(struct spinlock*);
+int             statslock(char*, int);
+
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -165,6 +214,7 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -173,6 +223,8 @@ uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             vmfault(pagetable_t, uint64, int);
+void            prefault(uint64, uint64);
 
 // plic.c
 void            plicinit(void);
@@ -183,6 +235,13 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+int             statsdisk(char*, int);
+int             virtio_disk_mode(char*);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_plug(void);
+void            virtio_disk_unplug(void);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
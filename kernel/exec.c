@@ -6,8 +6,39 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+static char *textlookup(struct inode *, uint, uint);
+static void textinsert(struct inode *, uint, uint, char *);
+
+// Pages of read-only program segments, shared by all the
+// processes that run the same executable. The cache holds
+// a reference to each page (see kdup()); processes map the
+// pages without PTE_W, so fork() shares them as well.
+// Lookups and inserts happen with the executable's inode
+// locked, and writei() and itrunc() drop the inode's pages,
+// so a cached page always matches the file.
+#define NTEXT 128
+
+struct textpage {
+  uint dev;
+  uint inum;
+  uint off;     // file offset of the page's contents
+  uint n;       // bytes from the file; the rest is zero
+  char *pa;     // 0 if the slot is free
+  uint used;    // for LRU replacement
+};
+
+static struct {
+  struct spinlock lock;
+  struct textpage page[NTEXT];
+  uint clock;
+  int hit;
+  int miss;
+} text;
 
 int flags2perm(int flags)
 {
@@ -26,8 +57,10 @@ exec(char *path, char **argv)
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
+  int nseg = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -49,7 +82,9 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Load program into memory. Segments are only recorded,
+  // and vmfault() reads their pages in as they are touched;
+  // any beyond NSEG are loaded now.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,6 +96,19 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr + ph.memsz > TRAPFRAME)
+      goto bad;
+    if(nseg < NSEG){
+      seg[nseg].va = ph.vaddr;
+      seg[nseg].memsz = ph.memsz;
+      seg[nseg].off = ph.off;
+      seg[nseg].filesz = ph.filesz;
+      seg[nseg].perm = flags2perm(ph.flags);
+      nseg++;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
@@ -68,6 +116,7 @@ exec(char *path, char **argv)
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
+  exe = exedup(ip);  // keep a reference for loadpage()
   iunlockput(ip);
   end_op();
   ip = 0;
@@ -121,12 +170,22 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  mmapexit(p);
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->exe = exe;
+  p->nseg = nseg;
+  memmove(p->seg, seg, sizeof(seg));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    exeput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,9 +196,36 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    exeput(exe);
+    end_op();
+  }
   return -1;
 }
 
+// Take a reference to executable ip for a process that runs
+// it. Since loadpage() reads pages from the file long after
+// exec(), writei() and open() for writing refuse to change
+// the file while any process runs it (ip->nexec > 0).
+// The first caller, exec(), holds ip's lock, which orders it
+// with those checks; later ones (fork()) find nexec > 0.
+struct inode*
+exedup(struct inode *ip)
+{
+  __sync_fetch_and_add(&ip->nexec, 1);
+  return idup(ip);
+}
+
+// Drop a reference taken by exedup().
+// Must be called inside a transaction since it calls iput().
+void
+exeput(struct inode *ip)
+{
+  __sync_fetch_and_sub(&ip->nexec, 1);
+  iput(ip);
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
@@ -164,3 +250,169 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
   
   return 0;
 }
+
+// Read the page at va of segment s of p's program from the
+// executable and map it. vmfault() calls this on the first
+// touch of the page. Pages of read-only segments come from,
+// and go into, the text cache.
+// Returns 0 on success, -1 on failure.
+int
+loadpage(struct proc *p, struct seg *s, uint64 va)
+{
+  uint64 n, off;
+  char *mem;
+  int locked, shared;
+
+  va = PGROUNDDOWN(va);
+  off = va - s->va;
+  n = 0;
+  if(off < s->filesz)
+    n = s->filesz - off < PGSIZE ? s->filesz - off : PGSIZE;
+  shared = n > 0 && (s->perm & PTE_W) == 0;
+
+  // the fault may come from copyin()/copyout() in a read
+  // or write of the executable itself.
+  locked = holdingsleep(&p->exe->lock);
+  if(n > 0 && !locked)
+    ilock(p->exe);
+  mem = 0;
+  if(shared)
+    mem = textlookup(p->exe, s->off + off, n);
+  if(mem == 0 && (mem = kalloc()) != 0){
+    memset(mem, 0, PGSIZE);
+    if(n > 0 && readi(p->exe, 0, (uint64)mem, s->off + off, n) != n){
+      kfree(mem);
+      mem = 0;
+    } else if(shared){
+      textinsert(p->exe, s->off + off, n, mem);
+    }
+  }
+  if(n > 0 && !locked)
+    iunlock(p->exe);
+  if(mem == 0)
+    return -1;
+
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_U|s->perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+void
+textinit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+// Look for the cached page holding n bytes at offset off of
+// ip, which must be locked. Returns the page with a new
+// reference for the caller, or 0.
+static char*
+textlookup(struct inode *ip, uint off, uint n)
+{
+  struct textpage *t;
+  char *pa = 0;
+
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum &&
+       t->off == off && t->n == n){
+      t->used = ++text.clock;
+      kdup(t->pa);
+      pa = t->pa;
+      break;
+    }
+  }
+  if(pa)
+    text.hit++;
+  else
+    text.miss++;
+  release(&text.lock);
+  return pa;
+}
+
+// Remember pa as the page holding n bytes at offset off of
+// ip, which must be locked, replacing the least recently
+// used page if the cache is full.
+static void
+textinsert(struct inode *ip, uint off, uint n, char *pa)
+{
+  struct textpage *t, *victim = 0;
+
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->pa == 0){
+      victim = t;
+      break;
+    }
+    if(victim == 0 || t->used < victim->used)
+      victim = t;
+  }
+  if(victim->pa)
+    kfree(victim->pa);
+  victim->dev = ip->dev;
+  victim->inum = ip->inum;
+  victim->off = off;
+  victim->n = n;
+  victim->pa = pa;
+  victim->used = ++text.clock;
+  kdup(pa);
+  ip->text = 1;
+  release(&text.lock);
+}
+
+// Drop the cached pages of ip, whose contents are about to
+// change or which is leaving the inode table. Processes that
+// map the pages keep their own references.
+void
+textinval(struct inode *ip)
+{
+  struct textpage *t;
+
+  if(ip->text == 0)
+    return;
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum){
+      kfree(t->pa);
+      t->pa = 0;
+    }
+  }
+  ip->text = 0;
+  release(&text.lock);
+}
+
+// Free the cached pages that no process maps.
+// kalloc() calls this when memory runs out.
+// Returns the number of pages freed.
+int
+textreclaim(void)
+{
+  struct textpage *t;
+  int n = 0;
+
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->pa && krefs(t->pa) == 1){
+      kfree(t->pa);
+      t->pa = 0;
+      n++;
+    }
+  }
+  release(&text.lock);
+  return n;
+}
+
+int
+statstext(char *buf, int sz)
+{
+  struct textpage *t;
+  int n = 0;
+
+  for(t = text.page; t < &text.page[NTEXT]; t++)
+    if(t->pa)
+      n++;
+  return snprintf(buf, sz, "--- text: %d pages cached, %d hits, %d misses\n",
+                  n, text.hit, text.miss);
+}
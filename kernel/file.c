@@ -13,6 +13,9 @@
 #include "stat.h"
 #include "proc.h"
 
+#define RAMIN 4   // first read-ahead window, in blocks
+#define RAMAX 32  // largest read-ahead window
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -91,6 +94,7 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
+    prefault(addr, sizeof(st));
     ilock(f->ip);
     stati(f->ip, &st);
     iunlock(f->ip);
@@ -101,6 +105,52 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Read directory entries of f into user buffer addr of n
+// bytes, continuing from where the last read left off.
+// Returns the number of bytes read, 0 at the end, or -1.
+int
+filegetdents(struct file *f, uint64 addr, int n)
+{
+  int r;
+
+  if(f->type != FD_INODE || f->readable == 0 || n < 0)
+    return -1;
+  begin_op();
+  r = readdirx(f->ip, addr, &f->off, n);
+  end_op();
+  return r;
+}
+
+// Sequential read-ahead for a read of n bytes at f->off.
+// A read that starts where the previous one ended doubles
+// f's window, up to RAMAX blocks, and the blocks that far
+// past this read are started into the buffer cache; any
+// other read closes the window.
+// Caller must hold f->ip->lock.
+static void
+fileahead(struct file *f, int n)
+{
+  uint start, end;
+
+  if(f->off != f->ranext || n <= 0){
+    f->rawin = 0;
+    f->raend = 0;
+    return;
+  }
+  if(f->rawin == 0)
+    f->rawin = RAMIN;
+  else if(f->rawin < RAMAX)
+    f->rawin *= 2;
+
+  start = (f->off + n) / BSIZE;
+  end = start + f->rawin;
+  if(start < f->raend)
+    start = f->raend;
+  if(start < end)
+    readahead(f->ip, start * BSIZE, (end - start) * BSIZE);
+  f->raend = end;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -111,6 +161,9 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // pipes and devices copy out while holding spinlocks.
+  prefault(addr, n);
+
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -119,8 +172,10 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    fileahead(f, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    f->ranext = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -139,6 +194,8 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  prefault(addr, n);
+
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -147,12 +204,10 @@ filewrite(struct file *f, uint64 addr, int n)
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum log transaction size (see MAXOPWRITE).
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = MAXOPWRITE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint ranext;       // FD_INODE: off at which a read is sequential
+  uint rawin;        // FD_INODE: read-ahead window, in blocks
+  uint raend;        // FD_INODE: blocks before this were read ahead
   short major;       // FD_DEVICE
 };
 
@@ -18,15 +21,33 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext;         // itable hash chain
+  struct inode *lnext, *lprev; // itable LRU list, if ref is 0
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int text;           // has pages in exec.c's text cache?
+  int nexec;          // processes running it, which deny writes
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  union {
+    uint addrs[NDIRECT+3];
+    struct {
+      struct extent ext[NEXTENT];
+      uint extblk;
+    };
+  };
+
+  // bmap()'s cache of the last indirect block it read that
+  // holds data block numbers, for multi-level lookups.
+  uint leaf;          // its block number, or 0
+  int leafslot;       // the addrs[] slot it is under
+  uint leafidx;       // which of that slot's leaves it is
+
+  uint lastblk;       // block last allocated to it, for balloc()
 };
 
 // map major device number to device functions.
@@ -38,3 +59,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
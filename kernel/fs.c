@@ -11,6 +11,7 @@
 
 #include "types.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "param.h"
 #include "stat.h"
@@ -26,6 +27,11 @@
 // only one device
 struct superblock sb; 
 
+static void bsuminit(int);
+static void isuminit(int);
+static void dcacheinit(void);
+static void dcachepurge(uint, uint);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +50,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  isuminit(dev);
 }
 
 // Zero a block.
@@ -59,27 +67,98 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// bsum keeps the number of free blocks that each bitmap
+// block records, so that balloc() can pass over full ones
+// without reading them. A count changes along with its
+// bit, while the bitmap block's buffer is locked.
 
-// Allocate a zeroed disk block.
+static struct {
+  struct spinlock lock;
+  int *nfree;    // free blocks per bitmap block
+  uint cursor;   // last block allocated
+} bsum;
+
+// Count the free blocks. Called by fsinit() after recovery.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+  int i, bi, n;
+
+  n = (sb.size + BPB - 1) / BPB;
+  if(n > PGSIZE / sizeof(int))
+    panic("bsuminit: too many bitmap blocks");
+  initlock(&bsum.lock, "bsum");
+  if((bsum.nfree = (int*)kalloc()) == 0)
+    panic("bsuminit: kalloc");
+  for(i = 0; i < n; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    bsum.nfree[i] = 0;
+    for(bi = 0; bi < BPB && i*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[i]++;
+    brelse(bp);
+  }
+}
+
+// Return the first clear bit in [from, to) of bitmap block
+// data, whose bits are for blocks base onwards, or -1. Looks
+// at 64 bits at a time.
+static int
+bfind(uchar *data, uint base, int from, int to)
+{
+  uint64 *w = (uint64*)data, x;
+  int i, j;
+
+  for(i = from / 64; i * 64 < to; i++){
+    x = w[i];
+    if(i == from / 64)
+      x |= (1UL << (from % 64)) - 1;  // not before from
+    if(x == ~0UL)
+      continue;
+    for(j = 0; x & (1UL << j); j++)
+      ;
+    if(i*64 + j >= to || base + i*64 + j >= sb.size)
+      return -1;
+    return i*64 + j;
+  }
+  return -1;
+}
+
+// Allocate a zeroed disk block: the first free one at or
+// after goal, or if goal is 0 after the block allocated
+// last, wrapping around at the end of the disk.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  int k, i, n, from, to, bi;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  n = (sb.size + BPB - 1) / BPB;
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.cursor + 1 < sb.size ? bsum.cursor + 1 : 0;
+
+  // the bitmap block of goal from goal on, the other blocks,
+  // then the first block up to goal.
+  for(k = 0; k <= n; k++){
+    i = (goal / BPB + k) % n;
+    from = k == 0 ? goal % BPB : 0;
+    to = k == n ? goal % BPB : BPB;
+    if(from >= to || bsum.nfree[i] == 0)
+      continue;
+    bp = bread(dev, sb.bmapstart + i);
+    if((bi = bfind(bp->data, i*BPB, from, to)) >= 0){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      acquire(&bsum.lock);
+      bsum.nfree[i]--;
+      bsum.cursor = i*BPB + bi;
+      release(&bsum.lock);
+      brelse(bp);
+      bzero(dev, i*BPB + bi);
+      return i*BPB + bi;
     }
     brelse(bp);
   }
@@ -87,6 +166,20 @@ balloc(uint dev)
   return 0;
 }
 
+// Allocate a block for ip, at goal if it is free, else near
+// the block ip got last.
+static uint
+iballoc(struct inode *ip, uint goal)
+{
+  uint b;
+
+  if(goal == 0 && ip->lastblk != 0)
+    goal = ip->lastblk + 1;
+  if((b = balloc(ip->dev, goal)) != 0)
+    ip->lastblk = b;
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -101,6 +194,9 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BPB]++;
+  release(&bsum.lock);
   brelse(bp);
 }
 
@@ -129,18 +225,19 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to an inode table entry (open files
+//   and current directories). iget() finds or creates a
+//   table entry and increments its ref; iput() decrements
+//   ref. An entry whose ref is zero stays in the table, on
+//   an LRU list, until iget() recycles it for another inode.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid when it frees
+//   the inode. A valid entry on the LRU list can be used
+//   again without reading the disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -167,50 +264,155 @@ bfree(int dev, uint b)
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock while using any of those
+// fields, or the hash chains and the LRU list.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 512
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  int n;                        // entries, sized by iinit()
+  struct inode *hash[NIHASH];   // entries that hold an inode
+  struct inode *lru;            // ref 0, most recently used first
+  struct inode *lrutail;
+  int hit;
+  int miss;
 } itable;
 
+// Put ip, whose ref has fallen to 0, on the LRU list: at the
+// front if it still holds a valid inode, else at the back,
+// to be recycled first.
+static void
+lruput(struct inode *ip)
+{
+  if(ip->valid){
+    ip->lprev = 0;
+    ip->lnext = itable.lru;
+    if(itable.lru)
+      itable.lru->lprev = ip;
+    else
+      itable.lrutail = ip;
+    itable.lru = ip;
+  } else {
+    ip->lnext = 0;
+    ip->lprev = itable.lrutail;
+    if(itable.lrutail)
+      itable.lrutail->lnext = ip;
+    else
+      itable.lru = ip;
+    itable.lrutail = ip;
+  }
+}
+
+static void
+lruremove(struct inode *ip)
+{
+  if(ip->lprev)
+    ip->lprev->lnext = ip->lnext;
+  else
+    itable.lru = ip->lnext;
+  if(ip->lnext)
+    ip->lnext->lprev = ip->lprev;
+  else
+    itable.lrutail = ip->lprev;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
+  struct inode *ip = 0;
+  int i, per = PGSIZE / sizeof(struct inode);
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  dcacheinit();
+  itable.n = (PHYSTOP - KERNBASE) / ICACHEFRAC / sizeof(struct inode);
+  if(itable.n < NINODE)
+    itable.n = NINODE;
+  for(i = 0; i < itable.n; i++){
+    if(i % per == 0 && (ip = (struct inode*)kalloc()) == 0)
+      panic("iinit: kalloc");
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    lruput(ip);
+    ip++;
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// isum keeps the number of free inodes in each inode block,
+// so that ialloc() can pass over full ones without reading
+// them. ialloc() takes from a count while the inode block's
+// buffer is locked; iput() gives back once it has freed the
+// inode, so a count may briefly be low.
+static struct {
+  struct spinlock lock;
+  int *nfree;    // free inodes per inode block
+} isum;
+
+// Count the free inodes. Called by fsinit() after recovery.
+static void
+isuminit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  int i, inum, n;
+
+  if(sb.ninodes > MAXINODES)
+    panic("isuminit: too many inodes");
+  n = (sb.ninodes + IPB - 1) / IPB;
+  initlock(&isum.lock, "isum");
+  if((isum.nfree = (int*)kalloc()) == 0)
+    panic("isuminit: kalloc");
+  for(i = 0; i < n; i++){
+    bp = bread(dev, IBLOCK(i*IPB, sb));
+    isum.nfree[i] = 0;
+    for(inum = i*IPB; inum < (i+1)*IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum != 0 && dip->type == 0)
+        isum.nfree[i]++;
+    }
+    brelse(bp);
+  }
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
+// The search starts at the inode block of near, usually the
+// new inode's directory, so that the entries of a directory
+// tend to share inode blocks and ls or find reads fewer.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  int i, k, n, inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  n = (sb.ninodes + IPB - 1) / IPB;
+  for(k = 0; k < n; k++){
+    i = (near / IPB + k) % n;
+    if(isum.nfree[i] == 0)
+      continue;
+    bp = bread(dev, IBLOCK(i*IPB, sb));
+    for(inum = i*IPB; inum < (i+1)*IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum != 0 && dip->type == 0){  // a free inode
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);   // mark it allocated on the disk
+        acquire(&isum.lock);
+        isum.nfree[i]--;
+        release(&isum.lock);
+        brelse(bp);
+        return iget(dev, inum);
+      }
     }
     brelse(bp);
   }
@@ -246,31 +448,40 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref == 0)
+        lruremove(ip);
       ip->ref++;
+      itable.hit++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Recycle the least recently used entry.
+  if((ip = itable.lrutail) == 0)
     panic("iget: no inodes");
+  lruremove(ip);
+  if(ip->inum != 0){
+    for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
+  itable.miss++;
 
-  ip = empty;
+  textinval(ip);  // cached pages are keyed by the old inode
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -310,6 +521,8 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->leaf = 0;
+    ip->lastblk = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -348,9 +561,13 @@ iput(struct inode *ip)
     release(&itable.lock);
 
     itrunc(ip);
+    dcachepurge(ip->dev, ip->inum);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    acquire(&isum.lock);
+    isum.nfree[ip->inum / IPB]++;
+    release(&isum.lock);
 
     releasesleep(&ip->lock);
 
@@ -358,9 +575,18 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0)
+    lruput(ip);
   release(&itable.lock);
 }
 
+int
+statsitable(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- itable: %d inodes, %d hits, %d misses\n",
+                  itable.n, itable.hit, itable.miss);
+}
+
 // Common idiom: unlock, then put.
 void
 iunlockput(struct inode *ip)
@@ -374,60 +600,235 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], the next NINDIRECT^2
+// in the blocks listed in block ip->addrs[NDIRECT+1], and
+// the next NINDIRECT^3 one level further down from block
+// ip->addrs[NDIRECT+2]. On a file system made
+// with SB_EXTENTS, ip->ext[] and block ip->extblk list the
+// blocks as extents instead (see fs.h).
+
+// Return extent i of ip, reading block ip->extblk into *bpp
+// if need be, or 0 if ip has no extent i yet.
+static struct extent*
+extent(struct inode *ip, int i, struct buf **bpp)
+{
+  if(i < NEXTENT)
+    return &ip->ext[i];
+  if(ip->extblk == 0)
+    return 0;
+  if(*bpp == 0)
+    *bpp = bread(ip->dev, ip->extblk);
+  return &((struct extent*)(*bpp)->data)[i - NEXTENT];
+}
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// bmap() for an extent-mapped inode. Files only grow at the
+// end, so a block that is not mapped yet is the one just
+// past the last extent. It goes right after that extent if
+// that block is free, which makes the extent longer.
+static uint
+bmapext(struct inode *ip, uint bn)
+{
+  struct extent *e, *last = 0;
+  struct buf *bp = 0;
+  uint base = 0, addr = 0, goal;
+  int i;
+
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if((e = extent(ip, i, &bp)) == 0 || e->len == 0)
+      break;
+    if(bn < base + e->len){
+      addr = e->start + (bn - base);
+      goto out;
+    }
+    base += e->len;
+    last = e;
+  }
+  if(bn != base)
+    panic("bmapext: hole");
+
+  goal = last ? last->start + last->len : 0;
+  if((addr = iballoc(ip, goal)) == 0)
+    goto out;
+  if(last && addr == goal){
+    last->len++;
+    if(i > NEXTENT)
+      log_write(bp);  // last is in block ip->extblk
+    goto out;
+  }
+  if(i == NEXTENT + NXEXTENT){
+    bfree(ip->dev, addr);  // out of extents
+    addr = 0;
+    goto out;
+  }
+  if(i == NEXTENT && ip->extblk == 0){
+    if((ip->extblk = iballoc(ip, 0)) == 0){
+      bfree(ip->dev, addr);
+      addr = 0;
+      goto out;
+    }
+  }
+  e = extent(ip, i, &bp);
+  e->start = addr;
+  e->len = 1;
+  if(bp)
+    log_write(bp);
+
+ out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// Return the block number at index bn of the tree of
+// indirect blocks, levels deep, under ip->addrs[slot],
+// allocating blocks as needed.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmapind(struct inode *ip, int slot, int levels, uint bn)
 {
-  uint addr, *a;
+  uint addr, span, *a;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
-    }
-    return addr;
+  if((addr = ip->addrs[slot]) == 0){
+    addr = iballoc(ip, 0);
+    if(addr == 0)
+      return 0;
+    ip->addrs[slot] = addr;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
+  // skip the upper levels if the leaf is the one last used.
+  if(levels > 1 && ip->leaf && ip->leafslot == slot && ip->leafidx == bn / NINDIRECT){
+    addr = ip->leaf;
+    levels = 1;
+  }
+
+  // each entry at this level covers span data blocks.
+  for(span = 1; levels > 1; levels--)
+    span *= NINDIRECT;
+  for(; span > 0; span /= NINDIRECT){
+    if(span == 1 && slot > NDIRECT){
+      ip->leaf = addr;
+      ip->leafslot = slot;
+      ip->leafidx = bn / NINDIRECT;
     }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+    if((addr = a[(bn / span) % NINDIRECT]) == 0){
+      addr = iballoc(ip, 0);
       if(addr){
-        a[bn] = addr;
+        a[(bn / span) % NINDIRECT] = addr;
         log_write(bp);
       }
     }
     brelse(bp);
+    if(addr == 0)
+      return 0;
+  }
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one.
+// returns 0 if out of disk space.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  uint addr;
+
+  if(sb.flags & SB_EXTENTS)
+    return bmapext(ip, bn);
+
+  if(bn < NDIRECT){
+    if((addr = ip->addrs[bn]) == 0){
+      addr = iballoc(ip, 0);
+      if(addr == 0)
+        return 0;
+      ip->addrs[bn] = addr;
+    }
     return addr;
   }
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT)
+    return bmapind(ip, NDIRECT, 1, bn);
+  bn -= NINDIRECT;
+
+  if(bn < NINDIRECT*NINDIRECT)
+    return bmapind(ip, NDIRECT+1, 2, bn);
+  bn -= NINDIRECT*NINDIRECT;
+
+  if(bn < NINDIRECT*NINDIRECT*NINDIRECT)
+    return bmapind(ip, NDIRECT+2, 3, bn);
 
   panic("bmap: out of range");
 }
 
+// Free indirect block addr, levels deep, and the blocks
+// under it.
+static void
+itruncind(struct inode *ip, uint addr, int levels)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(levels > 1)
+      itruncind(ip, a[j], levels - 1);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
+
+// itrunc() for an extent-mapped inode.
+static void
+itruncext(struct inode *ip)
+{
+  struct extent *e;
+  struct buf *bp = 0;
+  uint b;
+  int i;
+
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if((e = extent(ip, i, &bp)) == 0 || e->len == 0)
+      break;
+    for(b = e->start; b < e->start + e->len; b++)
+      bfree(ip->dev, b);
+  }
+  if(bp)
+    brelse(bp);
+  if(ip->extblk)
+    bfree(ip->dev, ip->extblk);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+}
+
+// The most blocks a file may have.
+static uint
+maxfile(void)
+{
+  if(sb.flags & SB_EXTENTS)
+    return MAXEXTFILE;
+  return MAXFILE;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  textinval(ip);
+  if(sb.flags & SB_EXTENTS){
+    itruncext(ip);
+    goto done;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -436,18 +837,15 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < 3; i++){
+    if(ip->addrs[NDIRECT+i]){
+      itruncind(ip, ip->addrs[NDIRECT+i], i + 1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  ip->leaf = 0;
 
+ done:
   ip->size = 0;
   iupdate(ip);
 }
@@ -464,6 +862,37 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading the blocks that hold bytes [off, off+n) of
+// ip into the buffer cache, without waiting for them.
+// Stops at the end of the file.
+// Caller must hold ip->lock.
+void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, addr[NVEC];
+  int m = 0;
+
+  if(off >= ip->size)
+    return;
+  if(n > ip->size - off)
+    n = ip->size - off;
+  end = (off + n + BSIZE - 1) / BSIZE;
+  // bmap() may wait for a buffer, so it must not run while
+  // the disk is plugged: requests already queued would not
+  // start, and the buffer's owner might be waiting for one.
+  // Each bprefetch() plugs for just its own batch.
+  for(bn = off / BSIZE; bn < end; bn++){
+    if((addr[m] = bmap(ip, bn)) == 0)
+      break;
+    if(++m == NVEC){
+      bprefetch(ip->dev, addr, m);
+      m = 0;
+    }
+  }
+  if(m > 0)
+    bprefetch(ip->dev, addr, m);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -510,9 +939,12 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if((uint64)off + n > (uint64)maxfile()*BSIZE)
     return -1;
+  if(ip->nexec > 0)
+    return -1;  // a running program (see exec.c)
 
+  textinval(ip);
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -546,6 +978,364 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// The name cache remembers the results of recent directory
+// lookups, keyed by (device, directory inum, name), so that
+// namex() can resolve most path elements without locking or
+// reading the directory. An entry with inum 0 records that
+// the name is absent. Entries are added and changed only
+// with the directory locked, by dirlookup() and dirlink();
+// sys_unlink() removes them, and iput() purges a directory's
+// entries when it is freed, before its inum can be reused.
+// The cache is set-associative, with LRU within a set.
+#define DCSETS 64
+#define DCWAYS 4
+
+struct dentry {
+  uint dev;
+  uint dir;          // inum of the directory
+  char name[DIRSIZ];
+  uint inum;         // 0 if name is not in dir
+  uint off;          // byte offset of the dirent, if inum != 0
+  uint used;         // last use, for LRU; 0 if the slot is free
+};
+
+static struct {
+  struct spinlock lock;
+  struct dentry set[DCSETS][DCWAYS];
+  uint clock;
+  int nhit;
+  int nneg;   // hits on entries for absent names
+  int nmiss;
+} dcache;
+
+static void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry*
+dcset(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return dcache.set[h % DCSETS];
+}
+
+// Find the entry for name in dir. Caller holds dcache.lock.
+static struct dentry*
+dcfind(uint dev, uint dir, char *name)
+{
+  struct dentry *d, *set = dcset(dev, dir, name);
+
+  for(d = set; d < &set[DCWAYS]; d++)
+    if(d->used && d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Look up name in directory dir. If the cache knows the
+// answer, set *ipp to the referenced inode or to 0 if the
+// name is absent, set *poff (if not 0) to the entry's
+// offset, and return 0. Return -1 if the cache does not know.
+static int
+dcachelookup(uint dev, uint dir, char *name, struct inode **ipp, uint *poff)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dev, dir, name)) == 0){
+    dcache.nmiss++;
+    release(&dcache.lock);
+    return -1;
+  }
+  d->used = ++dcache.clock;
+  *ipp = 0;
+  if(d->inum == 0){
+    dcache.nneg++;
+  } else {
+    dcache.nhit++;
+    if(poff)
+      *poff = d->off;
+    // take the reference before an unlink can free the inode.
+    *ipp = iget(dev, d->inum);
+  }
+  release(&dcache.lock);
+  return 0;
+}
+
+// Record that name in dp is inum at offset off, or absent
+// if inum is 0. Caller holds dp's lock.
+static void
+dcacheenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d, *e, *set;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) == 0){
+    set = dcset(dp->dev, dp->inum, name);
+    d = set;
+    for(e = set; e < &set[DCWAYS]; e++)
+      if(e->used < d->used)
+        d = e;
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->off = off;
+  d->used = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Forget name in dp, which is being removed.
+// Caller holds dp's lock.
+void
+dcacheremove(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) != 0)
+    d->used = 0;
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory dir, which is being freed.
+static void
+dcachepurge(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = &dcache.set[0][0]; d < &dcache.set[DCSETS][0]; d++)
+    if(d->used && d->dev == dev && d->dir == dir)
+      d->used = 0;
+  release(&dcache.lock);
+}
+
+int
+statsdcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- dcache: %d hits, %d negative hits, %d misses\n",
+                  dcache.nhit, dcache.nneg, dcache.nmiss);
+}
+
+// Hashed directories (see fs.h).
+
+// FNV-1a; mkfs has a copy.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+static struct dirhead*
+dirhead(uchar *b0)
+{
+  return (struct dirhead*)(b0 + 2*sizeof(struct dirent));
+}
+
+// Slot i of the index in block 0.
+static ushort*
+dirslot(uchar *b0, uint i)
+{
+  struct dirslots *s = (struct dirslots*)(b0 + 3*sizeof(struct dirent));
+
+  return &s[i / SLOTSPERENT].leaf[i % SLOTSPERENT];
+}
+
+// Is directory dp hashed? Caller holds dp's lock.
+static int
+dirhashed(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirhead *h;
+  int r;
+
+  if(dp->size <= BSIZE)
+    return 0;
+  bp = bread(dp->dev, bmap(dp, 0));
+  h = dirhead(bp->data);
+  r = h->inum == 0 && h->magic == DIRMAGIC;
+  brelse(bp);
+  return r;
+}
+
+// Look for name in hashed directory dp: block 0 for "." and
+// "..", else the one leaf that may hold it.
+// If found, set *poff and return its inum; else return 0.
+static uint
+dirhlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *b0, *bp;
+  struct dirent *de;
+  uint leaf, inum = 0;
+  int i;
+
+  b0 = bread(dp->dev, bmap(dp, 0));
+  de = (struct dirent*)b0->data;
+  for(i = 0; i < 2; i++){
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      *poff = i*sizeof(*de);
+      inum = de[i].inum;
+    }
+  }
+  leaf = *dirslot(b0->data, dirhash(name) & ((1 << dirhead(b0->data)->depth) - 1));
+  brelse(b0);
+  if(inum)
+    return inum;
+
+  bp = bread(dp->dev, bmap(dp, leaf));
+  de = (struct dirent*)bp->data;
+  for(i = 0; i < DPB; i++){
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      *poff = leaf*BSIZE + i*sizeof(*de);
+      inum = de[i].inum;
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Turn linear directory dp, whose one block is full, into a
+// hashed directory whose one leaf holds all but "." and "..".
+// Returns 0 on success, -1 if out of disk blocks.
+static int
+dirindex(struct inode *dp)
+{
+  struct buf *b0, *lp;
+  struct dirhead *h;
+  uint addr;
+  int n = 2*sizeof(struct dirent);
+
+  if((addr = bmap(dp, 1)) == 0)
+    return -1;
+  b0 = bread(dp->dev, bmap(dp, 0));
+  lp = bread(dp->dev, addr);
+  memmove(lp->data, b0->data + n, BSIZE - n);
+  memset(b0->data + n, 0, BSIZE - n);
+  h = dirhead(b0->data);
+  h->magic = DIRMAGIC;
+  h->depth = 0;
+  *dirslot(b0->data, 0) = 1;
+  log_write(lp);
+  log_write(b0);
+  brelse(lp);
+  brelse(b0);
+
+  dp->size = 2*BSIZE;
+  iupdate(dp);
+  // the entries have moved.
+  dcachepurge(dp->dev, dp->inum);
+  return 0;
+}
+
+// Split full leaf lp, directory block leaf, moving half of
+// its entries to a new leaf at the end of dp. b0 is dp's
+// block 0. Returns 0 on success, -1 if the index is at its
+// largest or out of disk blocks. Moving entries to a higher
+// offset means that readdirx() may return them twice, but
+// never skips them.
+static int
+dirsplit(struct inode *dp, struct buf *b0, struct buf *lp, uint leaf)
+{
+  struct dirhead *h = dirhead(b0->data);
+  struct dirent *de, *nde;
+  struct buf *np;
+  uint i, j, n, nref, bit, nleaf, addr;
+
+  n = 1 << h->depth;
+  for(nref = 0, i = 0; i < n; i++)
+    if(*dirslot(b0->data, i) == leaf)
+      nref++;
+  if(nref == 1 && h->depth == DIRMAXDEPTH)
+    return -1;
+  nleaf = dp->size / BSIZE;
+  if((addr = bmap(dp, nleaf)) == 0)
+    return -1;
+
+  if(nref == 1){
+    // leaf has a slot of its own: double the index.
+    for(i = 0; i < n; i++)
+      *dirslot(b0->data, n + i) = *dirslot(b0->data, i);
+    h->depth++;
+    n *= 2;
+    nref = 2;
+  }
+
+  // leaf's slots agree in their low log2(n/nref) bits; the
+  // next bit up decides which of the two leaves a name is in.
+  bit = n / nref;
+  np = bread(dp->dev, addr);
+  de = (struct dirent*)lp->data;
+  nde = (struct dirent*)np->data;
+  for(i = 0, j = 0; i < DPB; i++){
+    if(de[i].inum != 0 && (dirhash(de[i].name) & bit)){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  for(i = 0; i < n; i++)
+    if(*dirslot(b0->data, i) == leaf && (i & bit))
+      *dirslot(b0->data, i) = nleaf;
+  log_write(np);
+  log_write(lp);
+  log_write(b0);
+  brelse(np);
+
+  dp->size += BSIZE;
+  iupdate(dp);
+  dcachepurge(dp->dev, dp->inum);
+  return 0;
+}
+
+// Add (name, inum) to hashed directory dp.
+// Returns the entry's byte offset, or -1.
+static int
+dirhlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *b0, *lp;
+  struct dirent *de;
+  uint h = dirhash(name), leaf;
+  int i, split;
+
+  b0 = bread(dp->dev, bmap(dp, 0));
+  for(split = 0; ; split++){
+    leaf = *dirslot(b0->data, h & ((1 << dirhead(b0->data)->depth) - 1));
+    lp = bread(dp->dev, bmap(dp, leaf));
+    de = (struct dirent*)lp->data;
+    for(i = 0; i < DPB; i++){
+      if(de[i].inum == 0){
+        de[i].inum = inum;
+        strncpy(de[i].name, name, DIRSIZ);
+        log_write(lp);
+        brelse(lp);
+        brelse(b0);
+        return leaf*BSIZE + i*sizeof(*de);
+      }
+    }
+    // split at most once, to bound the blocks that one
+    // transaction writes; a leaf stays full after a split
+    // only if every name hashes to the same half.
+    if(split || dirsplit(dp, b0, lp, leaf) < 0){
+      brelse(lp);
+      brelse(b0);
+      return -1;
+    }
+    brelse(lp);
+  }
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -553,25 +1343,39 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct inode *ip;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  if(dcachelookup(dp->dev, dp->inum, name, &ip, poff) == 0)
+    return ip;
+
+  inum = 0;
+  if(dirhashed(dp)){
+    inum = dirhlookup(dp, name, &off);
+  } else {
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlookup read");
+      if(de.inum == 0)
+        continue;
+      if(namecmp(name, de.name) == 0){
+        // entry matches path element
+        inum = de.inum;
+        break;
+      }
     }
   }
 
-  return 0;
+  if(inum == 0){
+    dcacheenter(dp, name, 0, 0);
+    return 0;
+  }
+  if(poff)
+    *poff = off;
+  dcacheenter(dp, name, inum, off);
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
@@ -589,22 +1393,107 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(!dirhashed(dp)){
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+
+    // index the directory when its first block is full; one
+    // that outgrew it before it was hashed stays linear.
+    if(off != BSIZE || dp->size != BSIZE){
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        return -1;
+      dcacheenter(dp, name, inum, off);
+      return 0;
+    }
+
+    if(dirindex(dp) < 0)
+      return -1;
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if((off = dirhlink(dp, name, inum)) < 0)
     return -1;
-
+  dcacheenter(dp, name, inum, off);
   return 0;
 }
 
+#define DXBATCH 8  // entries that readdirx() takes at a time
+
+// Copy directory dp's entries from byte offset *poff on to
+// user address dst as struct direntx, as many as fit in n
+// bytes, advancing *poff past them.
+// Returns the number of bytes copied, 0 at the end, or -1,
+// e.g. if n is too small for one entry.
+// Must be called inside a transaction since it calls iput().
+//
+// dp is unlocked between calls, and between batches. As with
+// other systems' readdir(), entries created or removed in
+// the meantime may or may not be returned. A create may
+// also move entries that were there all along to a higher
+// offset, when it hashes the directory (dirindex()) or
+// splits a leaf (dirsplit()), so a reader that had already
+// passed them returns them again. No entry that stays in
+// the directory is missed.
+int
+readdirx(struct inode *dp, uint64 dst, uint *poff, int n)
+{
+  struct dirent de[DXBATCH];
+  struct inode *ip[DXBATCH];
+  struct direntx dx;
+  int i, m, max, bad = 0, tot = 0;
+
+  // 0 would mean the end of the directory.
+  if(n < (int)sizeof(dx))
+    return -1;
+  while((max = (n - tot) / (int)sizeof(dx)) > 0){
+    if(max > DXBATCH)
+      max = DXBATCH;
+    // take a batch of entries and references to their inodes
+    // with dp locked, so that none can be freed; lock the
+    // inodes only after unlocking dp, since one may be dp
+    // itself or its parent.
+    ilock(dp);
+    if(dp->type != T_DIR){
+      iunlock(dp);
+      return -1;
+    }
+    for(m = 0; m < max && *poff < dp->size; *poff += sizeof(de[0])){
+      if(readi(dp, 0, (uint64)&de[m], *poff, sizeof(de[0])) != sizeof(de[0]))
+        panic("readdirx read");
+      if(de[m].inum != 0){
+        ip[m] = iget(dp->dev, de[m].inum);
+        m++;
+      }
+    }
+    iunlock(dp);
+    if(m == 0)
+      break;
+
+    for(i = 0; i < m; i++){
+      memset(&dx, 0, sizeof(dx));
+      ilock(ip[i]);
+      dx.inum = ip[i]->inum;
+      dx.type = ip[i]->type;
+      dx.size = ip[i]->size;
+      iunlockput(ip[i]);
+      memmove(dx.name, de[i].name, DIRSIZ);
+      // keep going after a failure to drop the other references.
+      if(either_copyout(1, dst + tot, &dx, sizeof(dx)) < 0)
+        bad = 1;
+      tot += sizeof(dx);
+    }
+    if(bad)
+      return -1;
+  }
+  return tot;
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -659,6 +1548,16 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if((!nameiparent || *path != '\0') &&
+       dcachelookup(ip->dev, ip->inum, name, &next, 0) == 0){
+      // answered without locking or reading the directory;
+      // an entry exists only if ip is a directory.
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -20,13 +20,32 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // SB_* format options
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define SB_EXTENTS 0x1  // inodes map blocks with extents
+
+// addrs[] holds NDIRECT direct block numbers, then the
+// numbers of a singly-, a doubly- and a triply-indirect block.
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + NINDIRECT*NINDIRECT*NINDIRECT)
+
+// With SB_EXTENTS, an inode maps its blocks as a sequence of
+// extents: the first ext[0].len blocks of the file are at
+// ext[0].start onwards, and so on. After the NEXTENT in the
+// inode come up to NXEXTENT in block extblk. An extent with
+// len 0 ends the sequence.
+struct extent {
+  uint start;  // first disk block
+  uint len;    // number of blocks
+};
+
+#define NEXTENT 6
+#define NXEXTENT (BSIZE / sizeof(struct extent))
+#define MAXEXTFILE (0xffffffff / BSIZE)  // blocks; offsets are uints
 
 // On-disk inode structure
 struct dinode {
@@ -35,12 +54,23 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  union {
+    uint addrs[NDIRECT+3];   // Data block addresses
+    struct {                 // With SB_EXTENTS
+      struct extent ext[NEXTENT];
+      uint extblk;           // Block of further extents
+    };
+  };
 };
 
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
+// Most inodes a file system may have: isuminit() keeps a
+// count per inode block in one 4096-byte page. (dirent.inum,
+// a ushort, would allow more.)
+#define MAXINODES     ((4096 / sizeof(int)) * IPB)
+
 // Block containing inode i
 #define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
 
@@ -58,3 +88,47 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// getdents() fills its buffer with these.
+struct direntx {
+  ushort inum;
+  short type;             // of the inode, as in struct stat
+  uint size;              // of the inode
+  char name[DIRSIZ+1];    // always NUL-terminated
+};
+
+
+// Bytes of a file that one transaction may write. Not
+// aligned to blocks, they touch d = MAXOPWRITE/BSIZE + 1
+// blocks of data. Besides those, the write may dirty the
+// inode and 5 indirect blocks (a run in the triply-indirect
+// range can end in the next leaf under the next middle
+// block), and it allocates up to d data and 3 indirect
+// blocks, each of which balloc() may take from a different
+// bitmap block: 1 + 5 + d + (d + 3) <= MAXOPBLOCKS.
+#define MAXOPWRITE (((MAXOPBLOCKS-1-5-3)/2 - 1) * BSIZE)
+
+// Dirents per block
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory whose first block fills up is hashed instead
+// of growing linearly. Block 0 keeps "." and "..", then an
+// index in records that a linear reader sees as unused
+// dirents (inum 0); the other blocks are leaves of dirents.
+// Slot i of the index is the leaf holding the names whose
+// dirhash() has i as its low depth bits; a leaf that fills
+// is split in two, doubling the index if need be.
+#define DIRMAGIC 0x72696468   // "hdir"
+#define DIRMAXDEPTH 8         // at most 1<<8 slots and leaves
+#define SLOTSPERENT 7         // slots per index record
+
+struct dirhead {   // dirent 2 of block 0
+  ushort inum;     // always 0
+  ushort depth;    // the index has 1<<depth slots
+  uint magic;      // DIRMAGIC
+  uint pad[2];
+};
+
+struct dirslots {  // dirents 3 and on of block 0
+  ushort inum;     // always 0
+  ushort leaf[SLOTSPERENT];  // directory block of each slot
+};
@@ -1,6 +1,18 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each hart keeps its own free list, so kalloc() and kfree()
+// normally touch only hart-local state. Pages move between
+// the per-hart lists and a shared pool KBATCH at a time, and
+// a hart that finds both its own list and the pool empty
+// steals half of another hart's list. No code path holds
+// more than one free-list lock at a time.
+//
+// Every allocated page also has a reference count, so that
+// pages can be shared copy-on-write after fork(). kalloc()
+// returns a page with one reference; kfree() drops one and
+// only frees the page when the last reference goes away.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +21,8 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH 32  // pages moved to or from the pool at once
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,15 +32,28 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct freelist {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *head;
+  int n;              // number of pages on the list
+};
+
+// index into kmem.ref[] of the page at pa.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+struct {
+  struct freelist cpu[NCPU]; // per-hart free lists
+  struct freelist pool;      // shared by all harts
+  int nsteal;                // pages stolen from other harts
+  int ref[PA2REF(PHYSTOP)];  // references to each page
 } kmem;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem");
+  initlock(&kmem.pool.lock, "kmem.pool");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +62,121 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.ref[PA2REF(p)] = 1;
     kfree(p);
+  }
+}
+
+// Move up to n pages from the front of list from to the
+// front of list to. The caller must hold the locks of any
+// lists that are shared. Returns the number of pages moved.
+static int
+kmove(struct freelist *from, struct freelist *to, int n)
+{
+  struct run *first, *last;
+
+  if(n > from->n)
+    n = from->n;
+  if(n <= 0)
+    return 0;
+
+  first = last = from->head;
+  for(int i = 1; i < n; i++)
+    last = last->next;
+  from->head = last->next;
+  from->n -= n;
+  last->next = to->head;
+  to->head = first;
+  to->n += n;
+  return n;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference is dropped.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct freelist *c, spill;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&kmem.ref[PA2REF(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
+  spill.head = 0;
+  spill.n = 0;
+
+  push_off();
+  c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  r->next = c->head;
+  c->head = r;
+  c->n++;
+  // keep the hart's list bounded; give a batch back to the pool.
+  if(c->n >= 2*KBATCH)
+    kmove(c, &spill, KBATCH);
+  release(&c->lock);
+
+  if(spill.n > 0){
+    acquire(&kmem.pool.lock);
+    kmove(&spill, &kmem.pool, spill.n);
+    release(&kmem.pool.lock);
+  }
+  pop_off();
+}
+
+// Refill hart id's empty free list, first with a batch from
+// the pool and otherwise by stealing half of another hart's
+// list. Returns one of the pages for the caller to use, or 0
+// if there is no free memory anywhere.
+static struct run*
+krefill(int id)
+{
+  struct freelist tmp, *v;
+  struct run *r;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  tmp.head = 0;
+  tmp.n = 0;
+
+  acquire(&kmem.pool.lock);
+  kmove(&kmem.pool, &tmp, KBATCH);
+  release(&kmem.pool.lock);
+
+  for(int i = 1; tmp.n == 0 && i < NCPU; i++){
+    v = &kmem.cpu[(id + i) % NCPU];
+    acquire(&v->lock);
+    kmove(v, &tmp, (v->n + 1) / 2);
+    release(&v->lock);
+    if(tmp.n > 0)
+      __sync_fetch_and_add(&kmem.nsteal, tmp.n);
+  }
+
+  if(tmp.n == 0)
+    return 0;
+
+  r = tmp.head;
+  tmp.head = r->next;
+  tmp.n--;
+  if(tmp.n > 0){
+    acquire(&kmem.cpu[id].lock);
+    kmove(&tmp, &kmem.cpu[id], tmp.n);
+    release(&kmem.cpu[id].lock);
+  }
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +186,64 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct freelist *c;
+  int id;
+
+  push_off();
+  id = cpuid();
+  c = &kmem.cpu[id];
+  acquire(&c->lock);
+  r = c->head;
+  if(r){
+    c->head = r->next;
+    c->n--;
+  }
+  release(&c->lock);
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
 
-  if(r)
+  // out of memory: let the text and buffer caches give back
+  // the pages they can spare, and try again.
+  if(r == 0 && (textreclaim() > 0 || bshrink() > 0))
+    return kalloc();
+
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    kmem.ref[PA2REF(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Add a reference to the allocated page at pa,
+// e.g. when another page table starts sharing it.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&kmem.ref[PA2REF(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to the page at pa.
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(&kmem.ref[PA2REF(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Format free-page counts for the statistics device.
+int
+statskmem(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- kmem: pool %d pages, %d pages stolen\n",
+               kmem.pool.n, kmem.nsteal);
+  for(int i = 0; i < NCPU; i++)
+    if(kmem.cpu[i].n > 0)
+      n += snprintf(buf+n, sz-n, "hart %d: %d pages\n", i, kmem.cpu[i].n);
+  return n;
+}
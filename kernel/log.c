@@ -19,98 +19,200 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the logger has made room.
+//
+// Commits happen in the logger kernel thread, not in
+// end_op(): the last end_op() of a transaction wakes the
+// logger and returns at once. System calls that begin while
+// a commit is in progress all join the next transaction,
+// so a busy file system commits many of them together.
+// log_sync() waits until everything ended so far is on disk.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   header blocks, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// A commit appends its blocks after those of earlier
+// transactions and writes the header to cover them all.
+// Committed blocks stay pinned in the buffer cache, and are
+// only written to their home locations by a checkpoint,
+// which the logger runs when a begin_op() finds the log
+// full or the file system has gone idle. A block that many
+// transactions wrote goes home once, from its last copy.
+// The log counts as full, too, once its blocks would leave
+// the buffer cache too few buffers to run (see bpinmax()).
+
+// Blocks written to disk together by write_log(), each
+// batch with all its writes in flight.
+#define LOGBATCH 8
+
+// Ticks without an end_op() after which the logger
+// checkpoints.
+#define LOGIDLE 2
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Ints per header block. The header is the first nhead
+// blocks of the log, read as one array of ints: n, then n
+// block numbers. n is in the first block, so writing that
+// block last is what commits.
+#define HPB (BSIZE / sizeof(int))
+
+// Log header in memory: used for the committed blocks, as on
+// disk, and to keep track of logged block# before commit.
+// block is a page, which caps the log at PGSIZE/sizeof(int)
+// data blocks.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int *block;
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int nhead;       // header blocks, from the superblock.
+  int ndata;       // data blocks in use.
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int seq;         // number of the current transaction.
+  int done;        // number of the last committed transaction.
+  int nsync;       // processes waiting in log_sync().
+  int nspace;      // processes waiting in begin_op() for log space.
+  uint lastend;    // ticks at the last end_op().
+  void *chan;      // what the logger sleeps on.
+  int ncommit;     // transactions committed.
+  int nops;        // system calls they contained.
+  int nckpt;       // checkpoints.
+  int nlogged;     // blocks written to the log.
+  int ninstall;    // blocks written home.
   int dev;
-  struct logheader lh;
+  struct logheader ck; // committed, not yet installed; as on disk.
+  struct logheader lh; // the current transaction.
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void checkpoint(void);
+static void logger(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.nhead = 1;
+  while(log.nhead * HPB < 1 + (log.size - log.nhead))
+    log.nhead++;
+  log.ndata = log.size - log.nhead;
+  if(log.ndata > PGSIZE / sizeof(int))
+    log.ndata = PGSIZE / sizeof(int);
+  if(log.ndata < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  if((log.ck.block = (int*)kalloc()) == 0 || (log.lh.block = (int*)kalloc()) == 0)
+    panic("initlog: kalloc");
   log.dev = dev;
+  log.seq = 1;
+  log.chan = &log.lh;
   recover_from_log();
+  kthread("logger", logger);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks to their home locations: from the
+// log when recovering, else from the buffer cache, which
+// holds them pinned. Only the last copy of a block that
+// appears more than once is installed. The blocks are
+// marked dirty, and then written together in block order.
+// Recovery writes each block at once instead: it reads the
+// log blocks into buffers of their own, and a bget() that
+// found every buffer dirty would wait for this very
+// checkpoint to write them.
 static void
 install_trans(int recovering)
 {
-  int tail;
+  int i, j;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
+  for (i = 0; i < log.ck.n; i++) {
+    for (j = i+1; j < log.ck.n; j++)
+      if (log.ck.block[j] == log.ck.block[i])
+        break;
+    if (j < log.ck.n)
+      continue;  // a later transaction logged it again
+    struct buf *dbuf = bread(log.dev, log.ck.block[i]); // read dst
+    if (recovering) {
+      struct buf *lbuf = bread(log.dev, log.start+log.nhead+i); // read log block
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+      bwrite(dbuf);
+    } else {
+      bdirty(dbuf);
+      for (j = 0; j <= i; j++)
+        if (log.ck.block[j] == log.ck.block[i])
+          bunpin(dbuf);  // one bpin() per transaction
+    }
     brelse(dbuf);
+    log.ninstall++;
   }
+  bflush(log.dev);  // write dsts to disk
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy header block k between disk and log.ck.
 static void
-read_head(void)
+rw_head(int k, int write)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct buf *buf = bread(log.dev, log.start+k);
+  int *h = (int *) (buf->data);
+  int i, j;
+
+  for (i = 0; i < HPB; i++) {
+    j = k*HPB + i;  // index in the header's array of ints
+    if (j == 0) {
+      if (write)
+        h[i] = log.ck.n;
+      else
+        log.ck.n = h[i];
+    } else if (j-1 < log.ndata) {
+      if (write)
+        h[i] = log.ck.block[j-1];
+      else
+        log.ck.block[j-1] = h[i];
+    }
   }
+  if (write)
+    bwrite(buf);
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Read the log header from disk into the in-memory log header
+static void
+read_head(void)
+{
+  int k;
+
+  rw_head(0, 0);
+  if (log.ck.n < 0 || log.ck.n > log.ndata)
+    panic("read_head");
+  for (k = 1; k <= log.ck.n / HPB; k++)
+    rw_head(k, 0);
+}
+
+// Write in-memory header of committed blocks to disk, where
+// entries before from are there already.
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(int from)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
-  bwrite(buf);
-  brelse(buf);
+  int k;
+
+  for (k = log.ck.n / HPB; k > 0 && k >= (from+1) / HPB; k--)
+    rw_head(k, 1);
+  rw_head(0, 1);
 }
 
 static void
@@ -118,21 +220,30 @@ recover_from_log(void)
 {
   read_head();
   install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  log.ck.n = 0;
+  write_head(0); // clear the log
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  int max;
+
   acquire(&log.lock);
   while(1){
+    max = bpinmax();
+    if(max > log.ndata)
+      max = log.ndata;
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.ck.n + log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > max){
+      // this op might exhaust log space; wait for commit
+      // and checkpoint.
+      log.nspace++;
+      wakeup(log.chan);
       sleep(&log, &log.lock);
+      log.nspace--;
     } else {
       log.outstanding += 1;
       release(&log.lock);
@@ -142,19 +253,19 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation, the logger
+// will commit; end_op() does not wait for it.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.nops += 1;
+  log.lastend = ticks;
   if(log.committing)
     panic("log.committing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+    wakeup(log.chan);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -162,16 +273,74 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Wait until the updates of every FS system call that has
+// called end_op() are on disk.
+void
+log_sync(void)
+{
+  int seq;
+
+  acquire(&log.lock);
+  if(log.lh.n > 0 || log.outstanding > 0 || log.committing){
+    seq = log.seq;
+    log.nsync++;
+    wakeup(log.chan);
+    while(log.done < seq)
+      sleep(&log, &log.lock);
+    log.nsync--;
   }
+  release(&log.lock);
+}
+
+// The logger kernel thread: commit each transaction once
+// its last system call has ended, and checkpoint when the
+// log runs short of space or nothing has happened for a
+// while. While it waits for the latter, the logger wakes at
+// every clock tick.
+static void
+logger(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(log.outstanding == 0 && (log.lh.n > 0 || log.nsync > 0)){
+      log.committing = 1;
+      release(&log.lock);
+
+      // call commit w/o holding locks, since not allowed
+      // to sleep with locks.
+      commit();
+
+      acquire(&log.lock);
+      log.committing = 0;
+      log.done = log.seq++;
+      log.ncommit++;
+      wakeup(&log);
+    } else if(log.outstanding == 0 && log.ck.n > 0 &&
+              (log.nspace > 0 || ticks - log.lastend >= LOGIDLE)){
+      // no system call is active, so every block in the
+      // cache holds exactly what was committed.
+      log.committing = 1;
+      release(&log.lock);
+      checkpoint();
+      acquire(&log.lock);
+      log.committing = 0;
+      log.nckpt++;
+      wakeup(&log);
+    } else {
+      log.chan = log.ck.n > 0 ? (void*)&ticks : (void*)&log.lh;
+      sleep(log.chan, &log.lock);
+    }
+  }
+}
+
+int
+statslog(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- log: %d blocks, %d commits, %d ops, %d checkpoints, "
+                  "%d blocks logged, %d installed\n",
+                  log.ndata, log.ncommit, log.nops, log.nckpt, log.nlogged, log.ninstall);
 }
 
 // Copy modified blocks from cache to log.
@@ -180,28 +349,50 @@ write_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *to[LOGBATCH];
+  int i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if(n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bread(log.dev, log.start+log.nhead+log.ck.n+tail+i); // log block
+      struct buf *from = bread(log.dev, log.lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      brelse(from);
+    }
+    bwritev(to, n);  // write the log
+    log.nlogged += n;
+    for (i = 0; i < n; i++)
+      brelse(to[i]);
   }
 }
 
 static void
 commit()
 {
+  int i, from;
+
   if (log.lh.n > 0) {
     write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+    from = log.ck.n;
+    for (i = 0; i < log.lh.n; i++)
+      log.ck.block[log.ck.n+i] = log.lh.block[i];
+    log.ck.n += log.lh.n;
+    write_head(from); // Write header to disk -- the real commit
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
   }
 }
 
+static void
+checkpoint(void)
+{
+  install_trans(0); // Install writes to home locations
+  log.ck.n = 0;
+  write_head(0);   // Erase the transactions from the log
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
 // commit()/write_log() will do the disk write.
@@ -217,7 +408,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.ck.n + log.lh.n >= log.ndata)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
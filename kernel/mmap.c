@@ -0,0 +1,459 @@
+//
+// mmap() and munmap(): regions of user memory backed by a
+// file or, for anonymous mappings, by zeroed pages.
+// A process's mappings live in p->vma[]. They are placed
+// below the trapframe, growing down towards the heap, and
+// vmfault() fills in their pages on first touch.
+//
+// The pages of a MAP_SHARED mapping are also kept in a
+// struct shared, which fork() passes on to the child along
+// with the mapping. Whichever process first touches a page
+// puts it there, and the others then map the same page.
+//
+
+#include "types.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+struct shared {
+  struct sleeplock lock;  // protects pages
+  int ref;                // mappings using it; shtable.lock
+  pagetable_t pages;      // its pages, by offset from base
+  uint base;              // file offset of its first page
+};
+
+struct {
+  struct spinlock lock;
+  struct shared sh[NSHARED];
+} shtable;
+
+void
+mmapinit(void)
+{
+  struct shared *sh;
+
+  initlock(&shtable.lock, "shtable");
+  for(sh = shtable.sh; sh < &shtable.sh[NSHARED]; sh++)
+    initsleeplock(&sh->lock, "shared");
+}
+
+// Allocate a struct shared for a mapping at file offset off.
+static struct shared*
+shalloc(uint off)
+{
+  struct shared *sh;
+  pagetable_t pages;
+
+  if((pages = uvmcreate()) == 0)
+    return 0;
+  acquire(&shtable.lock);
+  for(sh = shtable.sh; sh < &shtable.sh[NSHARED]; sh++){
+    if(sh->ref == 0){
+      sh->ref = 1;
+      sh->pages = pages;
+      sh->base = off;
+      release(&shtable.lock);
+      return sh;
+    }
+  }
+  release(&shtable.lock);
+  kfree((void*)pages);
+  return 0;
+}
+
+static void
+shdup(struct shared *sh)
+{
+  acquire(&shtable.lock);
+  sh->ref++;
+  release(&shtable.lock);
+}
+
+// Free the pages under pt, a page table of the given level
+// (2 for the root), and then the page tables.
+static void
+shfree(pagetable_t pt, int level)
+{
+  int i;
+
+  for(i = 0; i < 512; i++){
+    if((pt[i] & PTE_V) == 0)
+      continue;
+    if(level > 0)
+      shfree((pagetable_t)PTE2PA(pt[i]), level - 1);
+    else
+      kfree((void*)PTE2PA(pt[i]));
+  }
+  kfree((void*)pt);
+}
+
+// Drop v's reference to its struct shared, freeing it and
+// its pages with the last one.
+static void
+shput(struct vma *v)
+{
+  struct shared *sh = v->sh;
+  pagetable_t pages;
+
+  v->sh = 0;
+  acquire(&shtable.lock);
+  if(--sh->ref > 0){
+    release(&shtable.lock);
+    return;
+  }
+  pages = sh->pages;
+  sh->pages = 0;
+  release(&shtable.lock);
+
+  shfree(pages, 2);
+}
+
+// Zero mem and read into it v's page at va from its file,
+// if it has one.
+static void
+fillpage(struct vma *v, uint64 va, char *mem)
+{
+  int locked;
+
+  memset(mem, 0, PGSIZE);
+  if(v->f){
+    // the fault may come from a read or write of the file.
+    locked = holdingsleep(&v->f->ip->lock);
+    if(!locked)
+      ilock(v->f->ip);
+    readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+    if(!locked)
+      iunlock(v->f->ip);
+  }
+}
+
+// Return the page at va of MAP_SHARED mapping v, with a
+// reference for the caller, filling it in if no process
+// sharing the mapping has touched it yet. Returns 0 if out
+// of memory.
+static char*
+sharedpage(struct vma *v, uint64 va)
+{
+  struct shared *sh = v->sh;
+  uint64 off = v->off + (va - v->addr) - sh->base;
+  pte_t *pte;
+  char *mem = 0;
+
+  acquiresleep(&sh->lock);
+  if((pte = walk(sh->pages, off, 1)) == 0)
+    goto out;
+  if(*pte & PTE_V){
+    mem = (char*)PTE2PA(*pte);
+  } else {
+    if((mem = kalloc()) == 0)
+      goto out;
+    fillpage(v, va, mem);
+    *pte = PA2PTE(mem) | PTE_R | PTE_V;  // sh's reference
+  }
+  kdup(mem);
+ out:
+  releasesleep(&sh->lock);
+  return mem;
+}
+
+// Return p's mapping that contains va, or 0.
+struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// The lowest address of any of p's mappings, which is as
+// far as the heap may grow.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && v->addr < base)
+      base = v->addr;
+  }
+  return base;
+}
+
+// Map len bytes of f starting at offset off, or zeroed
+// memory if f is 0, into the current process. The kernel
+// chooses the address; addr is ignored.
+// Returns the address, or -1.
+uint64
+mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w;
+  struct shared *sh = 0;
+  uint64 a;
+
+  if(len == 0 || len > TRAPFRAME || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE)
+      return -1;
+    if(!f->readable)
+      return -1;
+    if((prot & PROT_WRITE) && (flags & MAP_SHARED) && !f->writable)
+      return -1;
+  }
+  len = PGROUNDUP(len);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len == 0)
+      break;
+  if(v == &p->vma[NVMA])
+    return -1;
+
+  // take the highest free range that fits.
+  a = TRAPFRAME - len;
+ again:
+  for(w = p->vma; w < &p->vma[NVMA]; w++){
+    if(w->len > 0 && a < w->addr + w->len && w->addr < a + len){
+      if(w->addr < len)
+        return -1;
+      a = w->addr - len;
+      goto again;
+    }
+  }
+  if(a < PGROUNDUP(p->sz))
+    return -1;
+  if(flags & MAP_SHARED){
+    if((sh = shalloc(off)) == 0)
+      return -1;
+  }
+
+  v->addr = a;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->sh = sh;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  return a;
+}
+
+// Write the dirty page at va of shared mapping v back to
+// its file, a few blocks per transaction as in filewrite().
+// Only bytes that lie within the file are written; a
+// mapping never makes its file larger.
+static void
+writeback(struct vma *v, uint64 va, uint64 pa)
+{
+  struct inode *ip = v->f->ip;
+  int max = MAXOPWRITE;
+  uint off = v->off + (va - v->addr);
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    begin_op();
+    ilock(ip);
+    n = 0;
+    if(off + i < ip->size){
+      n = PGSIZE - i;
+      if(n > max)
+        n = max;
+      if(n > ip->size - (off + i))
+        n = ip->size - (off + i);
+      if(writei(ip, 0, pa + i, off + i, n) != n)
+        n = 0;
+    }
+    iunlock(ip);
+    end_op();
+    if(n == 0)
+      break;
+  }
+}
+
+// Remove [va, va+len) of mapping v from p's page table,
+// first writing back the pages of a shared file mapping
+// that were written.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  uint64 a;
+  pte_t *pte;
+
+  if(v->f && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)){
+    for(a = va; a < va + len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0)
+        continue;
+      if((*pte & PTE_V) && (*pte & PTE_D))
+        writeback(v, a, PTE2PA(*pte));
+    }
+  }
+  uvmunmap(p->pagetable, va, len/PGSIZE, 1);
+}
+
+// Unmap [addr, addr+len) of the current process. The range
+// must lie within one mapping and cover its start or end,
+// or both.
+// Returns 0 on success, -1 on failure.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = findvma(p, addr)) == 0 || addr + len > v->addr + v->len)
+    return -1;
+  if(addr != v->addr && addr + len != v->addr + v->len)
+    return -1;
+
+  vmaunmap(p, v, addr, len);
+  if(v->sh && v->len > len){
+    // no other process can touch the pages unmapped here
+    // if none shares v.
+    acquiresleep(&v->sh->lock);
+    if(v->sh->ref == 1)
+      uvmunmap(v->sh->pages, v->off + (addr - v->addr) - v->sh->base, len/PGSIZE, 1);
+    releasesleep(&v->sh->lock);
+  }
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    if(v->sh)
+      shput(v);
+    if(v->f){
+      fileclose(v->f);
+      v->f = 0;
+    }
+  }
+  return 0;
+}
+
+// Unmap all of p's mappings, as exit() and exec() must.
+void
+mmapexit(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    vmaunmap(p, v, v->addr, v->len);
+    v->len = 0;
+    if(v->sh)
+      shput(v);
+    if(v->f){
+      fileclose(v->f);
+      v->f = 0;
+    }
+  }
+}
+
+// Give child np the mappings of p. The pages p has touched
+// are shared: outright for MAP_SHARED mappings, so that
+// parent and child see each other's writes, and the child
+// faults the others in from the same struct shared; and
+// copy-on-write for MAP_PRIVATE mappings.
+// Returns 0 on success, -1 on failure.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->len,
+                    (v->flags & MAP_PRIVATE) != 0) < 0)
+      goto err;
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    np->vma[v - p->vma] = *v;
+    if(v->len > 0 && v->f)
+      filedup(v->f);
+    if(v->len > 0 && v->sh)
+      shdup(v->sh);
+  }
+  return 0;
+
+ err:
+  while(v-- > p->vma){
+    if(v->len > 0)
+      uvmunmap(np->pagetable, v->addr, v->len/PGSIZE, 1);
+  }
+  return -1;
+}
+
+// Handle a fault at va in mapping v of p, a write if write
+// is set. Pages of a shared, writable file mapping are
+// first mapped read-only unless the fault is a write, so
+// that the write fault can mark them dirty (PTE_D) for
+// writeback().
+// Returns 0 if the access can now proceed, -1 otherwise.
+int
+vmafault(struct proc *p, struct vma *v, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  int perm, track;
+
+  va = PGROUNDDOWN(va);
+  if(v->prot == PROT_NONE)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  track = v->f && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE);
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && track && (*pte & PTE_W) == 0){
+      *pte |= PTE_W | PTE_D;
+      sfence_vma();
+      return 0;
+    }
+    return -1;
+  }
+
+  if(v->sh){
+    if((mem = sharedpage(v, va)) == 0)
+      return -1;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    fillpage(v, va, mem);
+  }
+
+  perm = PTE_U | PTE_R;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(v->prot & PROT_WRITE){
+    if(!track)
+      perm |= PTE_W;
+    else if(write)
+      perm |= PTE_W | PTE_D;
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
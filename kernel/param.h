@@ -2,12 +2,21 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum size of the inode table
+#define ICACHEFRAC 2048  // inode table is 1/ICACHEFRAC of RAM, if larger
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define MAXOPBLOCKS  17  // max # of blocks any FS op writes
+#define LOGSIZE      (MAXOPBLOCKS*30) // default log blocks made by mkfs
+#define NBUF         (MAXOPBLOCKS*3)  // built-in disk block buffers
+#define BCACHEFRAC    4  // buffers may grow to 1/BCACHEFRAC of RAM
+#define NVEC         16  // max blocks in one disk request
+#define FSSIZE       20000 // default size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NSEG          4  // demand-paged program segments per process
+#define NVMA         16  // mmap() regions per process
+#define NSHARED      64  // MAP_SHARED mappings in the system
+#ifndef DISKMODE
+#define DISKMODE      0  // disk completions at boot: 0 interrupt, 1 poll, 2 hybrid
+#endif
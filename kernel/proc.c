@@ -162,6 +162,8 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  p->nseg = 0;
+  p->kfn = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -254,7 +256,54 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread that runs fn(), which must never
+// return. The thread is a process with no user memory that
+// never leaves the kernel.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
+// Cut p's program segments off at sz, so that memory grown
+// back above sz is zeroed, not read from the executable.
+static void
+segtrunc(struct proc *p, uint64 sz)
+{
+  struct seg *s;
+
+  for(s = p->seg; s < &p->seg[p->nseg]; s++){
+    if(s->va + s->memsz <= sz)
+      continue;
+    s->memsz = sz > s->va ? sz - s->va : 0;
+    if(s->filesz > s->memsz)
+      s->filesz = s->memsz;
+  }
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; vmfault() allocates each page
+// on first touch. Shrinking frees the pages that were used.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -264,11 +313,14 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    if(-(uint64)n > sz)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    segtrunc(p, sz);
   }
   p->sz = sz;
   return 0;
@@ -296,6 +348,18 @@ fork(void)
   }
   np->sz = p->sz;
 
+  if(mmapfork(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  // the child pages in the rest of the program itself.
+  if(p->exe)
+    np->exe = exedup(p->exe);
+  np->nseg = p->nseg;
+  memmove(np->seg, p->seg, sizeof(p->seg));
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -360,10 +424,15 @@ exit(int status)
     }
   }
 
+  mmapexit(p);
+
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    exeput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   acquire(&wait_lock);
 
@@ -394,6 +463,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout() below happens with spinlocks held.
+  if(addr != 0)
+    prefault(addr, sizeof(pp->xstate));
+
   acquire(&wait_lock);
 
   for(;;){
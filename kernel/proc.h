@@ -81,6 +81,27 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A PT_LOAD segment of the running program whose pages
+// vmfault() reads from the executable on first touch.
+struct seg {
+  uint64 va;                   // Page-aligned start address
+  uint64 memsz;                // Size in memory
+  uint off;                    // Offset in the executable
+  uint filesz;                 // Bytes backed by the file; rest is zero
+  int perm;                    // PTE_X and/or PTE_W
+};
+
+// A region of user memory created by mmap().
+struct vma {
+  uint64 addr;                 // Page-aligned start
+  uint64 len;                  // Multiple of PGSIZE; 0 if unused
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Backing file; 0 if anonymous
+  uint off;                    // Offset in f of addr
+  struct shared *sh;           // MAP_SHARED: pages shared with forks
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -103,5 +124,10 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable backing seg[]
+  int nseg;                    // Number of entries in seg[]
+  struct seg seg[NSEG];        // Segments not yet fully loaded
+  struct vma vma[NVMA];        // mmap() regions
+  void (*kfn)(void);           // Body of a kernel thread, else 0
   char name[16];               // Process name (debugging)
 };
@@ -8,12 +8,53 @@
 #include "proc.h"
 #include "defs.h"
 
+// Every initialized lock is recorded here, so that the
+// statistics device can report contention. Once the table
+// is full, further locks are only counted, in nuntracked.
+#define NLOCK 1000
+
+struct spinlock lock_locks = { .name = "lock_locks" };
+static struct spinlock *locks[NLOCK] = { &lock_locks };
+static int nuntracked;
+
+// Forget lk, which is about to be freed (e.g. a pipe's lock).
+void
+freelock(struct spinlock *lk)
+{
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == lk){
+      locks[i] = 0;
+      break;
+    }
+  }
+  release(&lock_locks);
+}
+
+static void
+findslot(struct spinlock *lk)
+{
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == 0){
+      locks[i] = lk;
+      release(&lock_locks);
+      return;
+    }
+  }
+  nuntracked++;
+  release(&lock_locks);
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->n = 0;
+  lk->nts = 0;
+  findslot(lk);
 }
 
 // Acquire the lock.
@@ -29,8 +70,9 @@ acquire(struct spinlock *lk)
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
+  __sync_fetch_and_add(&lk->n, 1);
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    __sync_fetch_and_add(&lk->nts, 1);
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -108,3 +150,53 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+static int
+snprint_lock(char *buf, int sz, struct spinlock *lk)
+{
+  return snprintf(buf, sz, "lock: %s: #test-and-set %d #acquire() %d\n",
+                  lk->name, lk->nts, lk->n);
+}
+
+// Format contention counts for the statistics device: every
+// kmem and bcache lock, then the most contended locks overall.
+int
+statslock(char *buf, int sz)
+{
+  struct spinlock *top[5];
+  int n, tot = 0;
+
+  acquire(&lock_locks);
+  n = snprintf(buf, sz, "--- lock kmem/bcache stats\n");
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == 0)
+      continue;
+    if(strncmp(locks[i]->name, "bcache", 6) == 0 ||
+       strncmp(locks[i]->name, "kmem", 4) == 0){
+      tot += locks[i]->nts;
+      n += snprint_lock(buf+n, sz-n, locks[i]);
+    }
+  }
+
+  n += snprintf(buf+n, sz-n, "--- top %d contended locks:\n", (int)NELEM(top));
+  memset(top, 0, sizeof(top));
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == 0 || locks[i]->nts == 0)
+      continue;
+    for(int j = 0; j < NELEM(top); j++){
+      if(top[j] == 0 || locks[i]->nts > top[j]->nts){
+        memmove(&top[j+1], &top[j], (NELEM(top)-j-1) * sizeof(top[0]));
+        top[j] = locks[i];
+        break;
+      }
+    }
+  }
+  for(int j = 0; j < NELEM(top) && top[j]; j++)
+    n += snprint_lock(buf+n, sz-n, top[j]);
+
+  n += snprintf(buf+n, sz-n, "tot= %d\n", tot);
+  if(nuntracked > 0)
+    n += snprintf(buf+n, sz-n, "%d locks not tracked: table full\n", nuntracked);
+  release(&lock_locks);
+  return n;
+}
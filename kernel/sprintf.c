@@ -0,0 +1,99 @@
+//
+// formatted output into a kernel buffer -- snprintf.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+static int
+sputc(char *s, int sz, int off, char c)
+{
+  if(off < sz)
+    s[off] = c;
+  return 1;
+}
+
+static int
+sprintint(char *s, int sz, int off, int xx, int base, int sign)
+{
+  char buf[16];
+  int i, n;
+  uint x;
+
+  if(sign && (sign = xx < 0))
+    x = -xx;
+  else
+    x = xx;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(sign)
+    buf[i++] = '-';
+
+  n = 0;
+  while(--i >= 0)
+    n += sputc(s, sz, off+n, buf[i]);
+  return n;
+}
+
+// Format into buf, which holds sz bytes. Only understands
+// %d, %x, %s. Output that does not fit is dropped. Returns
+// the number of bytes stored, which is at most sz; the
+// result is not NUL-terminated.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c, off;
+  char *s;
+
+  if(fmt == 0)
+    panic("null fmt");
+
+  off = 0;
+  va_start(ap, fmt);
+  for(i = 0; off < sz && (c = fmt[i] & 0xff) != 0; i++){
+    if(c != '%'){
+      off += sputc(buf, sz, off, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    if(c == 0)
+      break;
+    switch(c){
+    case 'd':
+      off += sprintint(buf, sz, off, va_arg(ap, int), 10, 1);
+      break;
+    case 'x':
+      off += sprintint(buf, sz, off, va_arg(ap, int), 16, 1);
+      break;
+    case 's':
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      for(; *s && off < sz; s++)
+        off += sputc(buf, sz, off, *s);
+      break;
+    case '%':
+      off += sputc(buf, sz, off, '%');
+      break;
+    default:
+      // Print unknown % sequence to draw attention.
+      off += sputc(buf, sz, off, '%');
+      off += sputc(buf, sz, off, c);
+      break;
+    }
+  }
+  va_end(ap);
+
+  return off < sz ? off : sz;
+}
@@ -84,6 +84,9 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
+  // allow supervisor mode to read the time CSR (r_time()).
+  w_mcounteren(r_mcounteren() | 2);
+
   // enable machine-mode timer interrupts.
   w_mie(r_mie() | MIE_MTIE);
 }
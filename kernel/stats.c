@@ -0,0 +1,102 @@
+//
+// The statistics device: reading it returns a text report
+// of kernel counters (lock contention, allocator state, ...),
+// and writing it sets a few run-time knobs (see statswrite).
+// init creates it as /statistics; user/stats.c prints it.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 4096  // room for any one section
+
+// The report's sections, in order.
+static int (*sections[])(char*, int) = {
+  statslock,
+  statskmem,
+  statstext,
+  statsbcache,
+  statsitable,
+  statsdcache,
+  statslog,
+  statsdisk,
+};
+
+static struct {
+  struct sleeplock lock;  // held across copyout, which may fault
+  char buf[BUFSZ];
+  int sec;  // next section to format
+  int sz;   // bytes of the current section in buf
+  int off;  // bytes already handed to the reader
+} stats;
+
+// A write is a command: "disk interrupt", "disk poll" or
+// "disk hybrid" sets how disk waits complete (DISKMODE is
+// only the boot-time choice).
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  char cmd[32];
+  int m;
+
+  if(n <= 0 || n >= sizeof(cmd))
+    return -1;
+  if(either_copyin(cmd, user_src, src, n) == -1)
+    return -1;
+  m = n;
+  if(cmd[m-1] == '\n')
+    m--;
+  cmd[m] = 0;
+  if(strncmp(cmd, "disk ", 5) == 0 && virtio_disk_mode(cmd+5) == 0)
+    return n;
+  return -1;
+}
+
+// Reads return the report a section at a time, each taken
+// when the reader reaches it, so that no section is cut
+// short for lack of room; then 0 at the end, after which the
+// next read starts over.
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  acquiresleep(&stats.lock);
+
+  while(stats.off == stats.sz && stats.sec < NELEM(sections)){
+    stats.sz = sections[stats.sec++](stats.buf, BUFSZ);
+    stats.off = 0;
+  }
+  m = stats.sz - stats.off;
+
+  if(m > 0){
+    if(m > n)
+      m = n;
+    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) == -1)
+      m = -1;
+    else
+      stats.off += m;
+  } else {
+    m = 0;
+    stats.sec = 0;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+  releasesleep(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initsleeplock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
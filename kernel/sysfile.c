@@ -107,6 +107,31 @@ sys_close(void)
   return 0;
 }
 
+// Wait until the file's data and metadata are on disk.
+// Everything in the log is, so this waits for the commit
+// of the file system calls made so far.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+// Commit the log and write back every dirty buffer.
+uint64
+sys_sync(void)
+{
+  log_sync();
+  bflushall();
+  return 0;
+}
+
 uint64
 sys_fstat(void)
 {
@@ -119,6 +144,20 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+uint64
+sys_getdents(void)
+{
+  struct file *f;
+  int n;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filegetdents(f, p, n);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -222,6 +261,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheremove(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -262,7 +302,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -341,6 +381,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program's file may not change (see exec.c).
+  if(ip->nexec > 0 && (omode & (O_WRONLY|O_RDWR|O_TRUNC))){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -355,6 +402,9 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->ranext = 0;
+    f->rawin = 0;
+    f->raend = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -503,3 +553,32 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int prot, flags, off;
+  struct file *f = 0;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  if(off < 0)
+    return -1;
+  return mmap(addr, len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
@@ -45,9 +45,17 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
+// how virtio_disk_wait() learns that a request is done
+// (see DISKMODE in param.h; writing "disk poll" etc. to
+// /statistics changes it).
+#define DISK_INTR   0  // sleep until the interrupt
+#define DISK_POLL   1  // spin on the used ring
+#define DISK_HYBRID 2  // spin for about a service time, then sleep
+#define DISK_SPINMAX 20000 // most timer ticks a wait spins
+
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -58,13 +66,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt when used idx passes this
 };
 
 // one entry in the "used" ring, with which the
@@ -78,6 +87,7 @@ struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify when avail idx passes this
 };
 
 // these are specific to virtio block devices, e.g. disks,
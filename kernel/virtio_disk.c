@@ -46,14 +46,44 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[NVEC];
+    int n;
     char status;
   } info[NUM];
 
+  // with VIRTIO_RING_F_INDIRECT_DESC, each request's chain
+  // lives in the table of its ring descriptor.
+  int indirect;
+  struct virtq_desc indirect_desc[NUM][NVEC+2];
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
   
+  // while plugged is non-zero, submissions leave the
+  // QUEUE_NOTIFY to virtio_disk_unplug(), so that a batch of
+  // requests costs the device one notification.
+  int plugged;
+  int kick;        // requests added since the last notification?
+
+  // with VIRTIO_RING_F_EVENT_IDX, the device says in
+  // used->avail_event when it next wants a notification,
+  // and we say in avail->used_event when we next want an
+  // interrupt.
+  int event_idx;
+  uint16 notified_idx; // avail->idx at the last notification check
+
+  // DISK_INTR, DISK_POLL or DISK_HYBRID.
+  int mode;
+  uint64 svctime;  // average r_time() ticks a wait lasts
+
+  // counters for statsdisk().
+  int nreq;    // requests submitted
+  int nkick;   // QUEUE_NOTIFY writes
+  int nintr;   // interrupts taken
+  int npoll;   // waits that ended while spinning
+  int nsleep;  // waits that ended in sleep()
+
   struct spinlock vdisk_lock;
   
 } disk;
@@ -64,6 +94,7 @@ virtio_disk_init(void)
   uint32 status = 0;
 
   initlock(&disk.vdisk_lock, "virtio_disk");
+  disk.mode = DISKMODE;
 
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
@@ -90,9 +121,9 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -116,6 +147,8 @@ virtio_disk_init(void)
     panic("virtio disk has no queue 0");
   if(max < NUM)
     panic("virtio disk max queue too short");
+  if(NVEC + 2 > NUM)
+    panic("virtio disk NVEC too large");
 
   // allocate and zero queue memory.
   disk.desc = kalloc();
@@ -196,12 +229,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,30 +244,97 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// Tell the device about new avail ring entries, if there
+// are any and, with EVENT_IDX, if it has asked to hear
+// about them: a device that is still working through the
+// ring will find them without a notification.
+// Caller must hold vdisk_lock.
+static void
+notify(void)
+{
+  uint16 old, new;
+
+  if(disk.kick == 0)
+    return;
+  disk.kick = 0;
+  if(disk.event_idx){
+    old = disk.notified_idx;
+    new = disk.avail->idx;
+    disk.notified_idx = new;
+    __sync_synchronize();
+    // the virtio spec's vring_need_event().
+    if((uint16)(new - disk.used->avail_event - 1) >= (uint16)(new - old))
+      return;
+  }
+  disk.nkick++;
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// Hold back device notifications until the matching
+// virtio_disk_unplug(), to submit a batch of requests.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_plug(void)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  acquire(&disk.vdisk_lock);
+  disk.plugged++;
+  release(&disk.vdisk_lock);
+}
 
+void
+virtio_disk_unplug(void)
+{
   acquire(&disk.vdisk_lock);
+  if(--disk.plugged == 0)
+    notify();
+  release(&disk.vdisk_lock);
+}
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+// Start a read or write of the n buffers in bs, which must
+// hold consecutive blocks, as one request, and return
+// without waiting for it. When the device finishes,
+// virtio_disk_intr() clears each buffer's disk flag and
+// calls its iodone hook if it is set, or wakes up
+// virtio_disk_wait() otherwise.
+void
+virtio_disk_submitv(struct buf **bs, int n, int write)
+{
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+  struct virtq_desc *c[NVEC+2];
+  int idx[NVEC+2];
+  int i, nd, head;
+
+  if(n < 1 || n > NVEC)
+    panic("virtio_disk_submitv");
 
-  // allocate the three descriptors.
-  int idx[3];
+  acquire(&disk.vdisk_lock);
+
+  // the spec's Section 5.2 says that block operations use a
+  // descriptor for type/reserved/sector, then descriptors
+  // for the data, then one for a 1-byte status result.
+  // with indirect descriptors, that chain lives in a table
+  // of its own, and the ring needs just one descriptor.
+  nd = disk.indirect ? 1 : n + 2;
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, nd) == 0) {
       break;
     }
+    notify();  // the device must see queued requests to free any
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
+  head = idx[0];
+  for(i = 0; i < n + 2; i++){
+    if(disk.indirect){
+      c[i] = &disk.indirect_desc[head][i];
+      idx[i] = i;
+    } else {
+      c[i] = &disk.desc[idx[i]];
+    }
+  }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &disk.ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -244,32 +343,45 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  c[0]->addr = (uint64) buf0;
+  c[0]->len = sizeof(struct virtio_blk_req);
+  c[0]->flags = VRING_DESC_F_NEXT;
+  c[0]->next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1; i <= n; i++){
+    c[i]->addr = (uint64) bs[i-1]->data;
+    c[i]->len = BSIZE;
+    if(write)
+      c[i]->flags = 0; // device reads b->data
+    else
+      c[i]->flags = VRING_DESC_F_WRITE; // device writes b->data
+    c[i]->flags |= VRING_DESC_F_NEXT;
+    c[i]->next = idx[i+1];
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.info[head].status = 0xff; // device writes 0 on success
+  c[n+1]->addr = (uint64) &disk.info[head].status;
+  c[n+1]->len = 1;
+  c[n+1]->flags = VRING_DESC_F_WRITE; // device writes the status
+  c[n+1]->next = 0;
+
+  if(disk.indirect){
+    disk.desc[head].addr = (uint64) disk.indirect_desc[head];
+    disk.desc[head].len = (n + 2) * sizeof(struct virtq_desc);
+    disk.desc[head].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[head].next = 0;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the bufs for virtio_disk_intr().
+  for(i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    disk.info[head].b[i] = bs[i];
+  }
+  disk.info[head].n = n;
+  disk.nreq++;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % NUM] = head;
 
   __sync_synchronize();
 
@@ -278,19 +390,115 @@ virtio_disk_rw(struct buf *b, int write)
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.kick = 1;
+  if(disk.plugged == 0)
+    notify();
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
+  release(&disk.vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
 
+static void complete(void);
+
+// Wait for b's request to finish. In DISK_POLL and
+// DISK_HYBRID modes, first spin on the used ring, which
+// saves the trip through the PLIC, virtio_disk_intr() and
+// the scheduler. A hybrid wait spins for about twice the
+// average service time before it gives up and sleeps; a
+// polling one for up to DISK_SPINMAX ticks, so that a slow
+// request does not hold the CPU.
+void
+virtio_disk_wait(struct buf *b)
+{
+  uint64 start, limit, t;
+
+  acquire(&disk.vdisk_lock);
+  notify();  // b may be in a plugged batch
+  start = r_time();
+  if(disk.mode != DISK_INTR){
+    limit = DISK_SPINMAX;
+    if(disk.mode == DISK_HYBRID && 2 * disk.svctime < limit)
+      limit = 2 * disk.svctime;
+    while(b->disk == 1){
+      if(disk.used_idx != disk.used->idx){
+        complete();
+        continue;
+      }
+      if(r_time() - start >= limit)
+        break;
+      // let virtio_disk_intr() and other submitters in.
+      release(&disk.vdisk_lock);
+      acquire(&disk.vdisk_lock);
+    }
+    if(b->disk == 0)
+      disk.npoll++;
+  }
+  if(b->disk == 1){
+    while(b->disk == 1) {
+      sleep(b, &disk.vdisk_lock);
+    }
+    disk.nsleep++;
+  }
+  t = r_time() - start;
+  disk.svctime = (7 * disk.svctime + t) / 8;
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
+
+// Finish the requests the device has added to the used
+// ring. Caller must hold vdisk_lock.
+static void
+complete(void)
+{
+ again:
+  // the device increments disk.used->idx when it
+  // adds an entry to the used ring.
+
+  while(disk.used_idx != disk.used->idx){
+    __sync_synchronize();
+    int id = disk.used->ring[disk.used_idx % NUM].id;
+
+    if(disk.info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    free_chain(id);
+    for(int i = 0; i < disk.info[id].n; i++){
+      struct buf *b = disk.info[id].b[i];
+      disk.info[id].b[i] = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->iodone)
+        b->iodone(b);
+      else
+        wakeup(b);
+    }
+
+    disk.used_idx += 1;
+  }
+
+  // with EVENT_IDX, ask for an interrupt at the next
+  // completion only; those that land while we are working
+  // through the ring cost none. a completion may have
+  // slipped in before the device saw used_event, so look
+  // once more.
+  if(disk.event_idx){
+    disk.avail->used_event = disk.used_idx;
+    __sync_synchronize();
+    if(disk.used_idx != disk.used->idx)
+      goto again;
+  }
+}
+
 void
 virtio_disk_intr()
 {
@@ -303,25 +511,43 @@ virtio_disk_intr()
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  disk.nintr++;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  complete();
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+  release(&disk.vdisk_lock);
+}
 
-    disk.used_idx += 1;
+static char *modename[] = {
+[DISK_INTR]   "interrupt",
+[DISK_POLL]   "poll",
+[DISK_HYBRID] "hybrid",
+};
+
+// Switch to the completion mode called name, for waits that
+// start from now on. Returns 0, or -1 if there is no such
+// mode.
+int
+virtio_disk_mode(char *name)
+{
+  for(int i = 0; i < NELEM(modename); i++){
+    if(strncmp(name, modename[i], strlen(modename[i]) + 1) == 0){
+      acquire(&disk.vdisk_lock);
+      disk.mode = i;
+      release(&disk.vdisk_lock);
+      return 0;
+    }
   }
+  return -1;
+}
 
-  release(&disk.vdisk_lock);
+int
+statsdisk(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- disk (%s): %d requests, %d notifications, %d interrupts, "
+                  "%d waits polled, %d slept\n",
+                  modename[disk.mode], disk.nreq, disk.nkick, disk.nintr,
+                  disk.npoll, disk.nsleep);
 }
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -172,7 +174,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never populated (see
+// vmfault()) are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -185,9 +188,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -303,42 +306,184 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, make the child's
+// page table share the parent's memory copy-on-write.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 1);
+}
+
+// Map the pages of old in [va, va+len) at the same place in
+// new. With cow set, writable pages become read-only PTE_COW
+// pages in both page tables, and cowfault() copies them on
+// the first write; otherwise they stay writable and shared.
+// Each shared physical page gains a reference.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = va; i < va + len; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not populated yet; the child faults it in too.
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Resolve a write to the copy-on-write page at va by giving
+// pagetable its own writable copy of the page, or, if no
+// one else shares the page any more, by simply making it
+// writable again.
+// Returns 0 on success, -1 if va is not a user COW page
+// or there is no memory for the copy.
+static int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, PGROUNDDOWN(va), 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+
+  if(krefs((void*)pa) == 1){
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Does this CPU hold a spinlock? A fault taken by a copy
+// function called with one held must not sleep.
+static int
+spinning(void)
+{
+  int n;
+
+  push_off();
+  n = mycpu()->noff;
+  pop_off();
+  return n > 1;
+}
+
+// Handle a fault on user address va in pagetable, which is
+// a write if write is set. A write to a copy-on-write page
+// gets a private copy; faults in mmap() regions go to
+// vmafault(); an untouched page of the program is read from
+// the executable; any other untouched page below the
+// current process's size (sbrk() grows lazily) gets a
+// zeroed page.
+// Used by usertrap() and by the copy functions below.
+// Filling an mmap() or program page may sleep, so a caller
+// holding a spinlock gets -1 for those instead; see
+// prefault().
+// Returns 0 if the access can now proceed, -1 if it is
+// invalid or memory is exhausted.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V) && write && (*pte & PTE_COW))
+    return cowfault(pagetable, va);
+  if(p == 0 || pagetable != p->pagetable)
+    return -1;
+  if((v = findvma(p, va)) != 0){
+    if(!(pte && (*pte & PTE_V)) && spinning())
+      return -1;
+    return vmafault(p, v, va, write);
+  }
+  if((pte && (*pte & PTE_V)) || va >= p->sz)
+    return -1;
+
+  for(s = p->seg; s < &p->seg[p->nseg]; s++){
+    if(va >= s->va && va < s->va + s->memsz)
+      return spinning() ? -1 : loadpage(p, s, va);
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+prefaultrange(struct proc *p, uint64 va, uint64 n, uint64 start, uint64 len)
+{
+  uint64 a, end;
+
+  a = va > start ? PGROUNDDOWN(va) : start;
+  end = va + n < start + len ? va + n : start + len;
+  for(; a < end; a += PGSIZE){
+    if(walkaddr(p->pagetable, a) == 0)
+      vmfault(p->pagetable, a, 0);
+  }
+}
+
+// Fault in the pages of [va, va+n) in the current process
+// whose faults may sleep: program pages and mmap() regions,
+// which vmfault() refuses to fill with a spinlock held.
+// Callers that copy while holding spinlocks, or the lock of
+// another inode, call this first for the copy to succeed.
+// Failures are left for the copy itself to report.
+void
+prefault(uint64 va, uint64 n)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  struct vma *v;
+
+  if(va + n < va)
+    return;
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    prefaultrange(p, va, n, s->va, s->memsz);
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0)
+      prefaultrange(p, va, n, v->addr, v->len);
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -366,8 +511,13 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(va0 >= MAXVA)
       return -1;
     pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0){
+      // not populated yet, or copy-on-write.
+      if(vmfault(pagetable, va0, 1) < 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_U) == 0)
       return -1;
     pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
@@ -393,8 +543,11 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -420,8 +573,11 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -20,9 +20,12 @@
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int fssize = FSSIZE;  // -s: size of file system in blocks
+int ninodes = NINODES; // -i: number of inodes
+int nlog = LOGSIZE;   // -l: number of log blocks
+int extents;          // -e: map file blocks with extents
+int nbitmap;
+int ninodeblocks;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,7 +43,9 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void wdir(uint inum, struct dirent *de, int n);
 void die(const char *);
+void usage(void);
 
 // convert to riscv byte order
 ushort
@@ -68,18 +73,45 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, c, cc, fd, nde;
+  uint rootino, inum;
+  struct dirent *de;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  while((c = getopt(argc, argv, "s:l:i:e")) != -1){
+    switch(c){
+    case 'e':
+      extents = 1;
+      break;
+    case 's':
+      fssize = atoi(optarg);
+      break;
+    case 'l':
+      nlog = atoi(optarg);
+      break;
+    case 'i':
+      ninodes = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if(argc < 2)
+    usage();
+  // initlog() needs room for a header block and one
+  // transaction; isuminit() and dirents bound the inodes.
+  if(nlog < MAXOPBLOCKS + 1){
+    fprintf(stderr, "mkfs: need at least %d log blocks\n", MAXOPBLOCKS + 1);
+    usage();
+  }
+  if(ninodes < ROOTINO + 1 || ninodes > MAXINODES){
+    fprintf(stderr, "mkfs: inodes must be %d to %d\n", ROOTINO + 1, (int)MAXINODES);
+    usage();
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
@@ -90,24 +122,31 @@ main(int argc, char *argv[])
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if(nmeta >= fssize){
+    fprintf(stderr, "mkfs: %d blocks is too small\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.flags = xint(extents ? SB_EXTENTS : 0);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
+  for(i = 0; i < fssize; i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
@@ -117,15 +156,14 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  // the root's entries, written by wdir() once all are known.
+  if((de = calloc(argc, sizeof(*de))) == 0)
+    die("calloc");
+  de[0].inum = xshort(rootino);
+  strcpy(de[0].name, ".");
+  de[1].inum = xshort(rootino);
+  strcpy(de[1].name, "..");
+  nde = 2;
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -149,10 +187,9 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    de[nde].inum = xshort(inum);
+    strncpy(de[nde].name, shortname, DIRSIZ);
+    nde++;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,12 +197,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, de, nde);
 
   balloc(freeblock);
 
@@ -223,6 +255,10 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes\n");
+    exit(1);
+  }
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -235,20 +271,69 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used < nbitmap*BPB);
+  for(b = 0; b*BPB < used; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b*BPB + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block of file block fbn of the extent-mapped
+// inode din, allocating it if fbn is just past the end. mkfs
+// allocates blocks in order, so files rarely need more than
+// the extents in the inode itself, and mkfs uses no others.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  uint base = 0;
+  int i;
+
+  for(i = 0; i < NEXTENT && din->ext[i].len; i++){
+    if(fbn < base + xint(din->ext[i].len))
+      return xint(din->ext[i].start) + fbn - base;
+    base += xint(din->ext[i].len);
+  }
+  assert(fbn == base);
+  if(i > 0 && xint(din->ext[i-1].start) + xint(din->ext[i-1].len) == freeblock){
+    din->ext[i-1].len = xint(xint(din->ext[i-1].len) + 1);
+  } else {
+    if(i == NEXTENT){
+      fprintf(stderr, "mkfs: out of extents\n");
+      exit(1);
+    }
+    din->ext[i].start = xint(freeblock);
+    din->ext[i].len = xint(1);
+  }
+  return freeblock++;
+}
+
+// Return entry i of the indirect block whose number is at
+// *blk, allocating the block and the entry as needed. blk
+// and the result are in riscv byte order.
+uint
+indirect(uint *blk, uint i)
+{
+  uint a[NINDIRECT];
+
+  if(xint(*blk) == 0)
+    *blk = xint(freeblock++);
+  rsect(xint(*blk), (char*)a);
+  if(a[i] == 0){
+    a[i] = xint(freeblock++);
+    wsect(xint(*blk), (char*)a);
+  }
+  return a[i];
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -256,7 +341,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -264,22 +348,20 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    // mkfs uses no triply-indirect blocks.
+    assert(extents || fbn < NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT);
+    if(extents){
+      x = emap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
+    } else if(fbn < NDIRECT + NINDIRECT){
+      x = xint(indirect(&din.addrs[NDIRECT], fbn - NDIRECT));
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = indirect(&din.addrs[NDIRECT+1], (fbn - NDIRECT - NINDIRECT) / NINDIRECT);
+      x = xint(indirect(&x, (fbn - NDIRECT - NINDIRECT) % NINDIRECT));
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -293,6 +375,78 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// FNV-1a, as dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Write directory inum's n entries, "." and ".." first. If
+// they do not fit in one block, lay the directory out hashed,
+// as the kernel's dirlink() would (see fs.h), with a leaf
+// for each slot of the smallest index that has room.
+void
+wdir(uint inum, struct dirent *de, int n)
+{
+  char b0[BSIZE], leaf[BSIZE];
+  struct dirhead *h;
+  struct dirslots *slots;
+  uint depth, i, j, k, cnt[1 << DIRMAXDEPTH];
+  struct dinode din;
+
+  if(n <= DPB){
+    iappend(inum, de, n * sizeof(*de));
+    // round the directory up to a whole block.
+    rinode(inum, &din);
+    din.size = xint(BSIZE);
+    winode(inum, &din);
+    return;
+  }
+
+  for(depth = 0; ; depth++){
+    assert(depth <= DIRMAXDEPTH);
+    memset(cnt, 0, sizeof(cnt));
+    for(i = 2; i < n; i++)
+      cnt[dirhash(de[i].name) & ((1 << depth) - 1)]++;
+    for(j = 0; j < (1 << depth); j++)
+      if(cnt[j] > DPB)
+        break;
+    if(j == (1 << depth))
+      break;
+  }
+
+  memset(b0, 0, sizeof(b0));
+  memmove(b0, de, 2 * sizeof(*de));
+  h = (struct dirhead*)(b0 + 2 * sizeof(*de));
+  h->magic = xint(DIRMAGIC);
+  h->depth = xshort(depth);
+  slots = (struct dirslots*)(b0 + 3 * sizeof(*de));
+  for(j = 0; j < (1 << depth); j++)
+    slots[j / SLOTSPERENT].leaf[j % SLOTSPERENT] = xshort(1 + j);
+  iappend(inum, b0, BSIZE);
+
+  for(j = 0; j < (1 << depth); j++){
+    memset(leaf, 0, sizeof(leaf));
+    for(i = 2, k = 0; i < n; i++)
+      if((dirhash(de[i].name) & ((1 << depth) - 1)) == j)
+        memmove(leaf + k++ * sizeof(*de), &de[i], sizeof(*de));
+    iappend(inum, leaf, BSIZE);
+  }
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: mkfs [-e] [-s blocks] [-l logblocks] [-i inodes] fs.img files...\n");
+  exit(1);
+}
+
 void
 die(const char *s)
 {
@@ -22,8 +22,8 @@ void extract_filename(char *buf,const char *path){
 void find(char * path,int file_cnt,char *filename[]){
 	// printf("Current path:\t%s\n",path);
 	char buf[512], *p;
-  	int fd;
-  	struct dirent de;
+  	int fd, n;
+  	struct direntx de[8], *d;
   	struct stat st;
 	// printf("Path:\t%s\n",path);
 	if((fd = open(path, O_RDONLY)) < 0){
@@ -49,17 +49,12 @@ void find(char * path,int file_cnt,char *filename[]){
     strcpy(buf, path);
     p = buf+strlen(buf);
     *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        continue;
-      }
-	  if (st.type==T_DIR&&buf[strlen(buf)-1]!='.') {
+    while((n = getdents(fd, de, sizeof(de))) > 0){
+     for (d = de; d < de + n/sizeof(*d); d++) {
+      strcpy(p, d->name);
+	  if (d->type==T_DIR&&buf[strlen(buf)-1]!='.') {
 		find(buf,file_cnt, filename);
-	  }else if (st.type==T_FILE) {
+	  }else if (d->type==T_FILE) {
 		if (file_cnt!=0) {
 			char temp[15];
 			extract_filename(temp, buf);
@@ -72,6 +67,7 @@ void find(char * path,int file_cnt,char *filename[]){
 			printf("%s\n", (buf));
 		}
 	  }
+     }
     }
     break;
   }
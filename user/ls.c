@@ -27,8 +27,8 @@ void
 ls(char *path)
 {
   char buf[512], *p;
-  int fd;
-  struct dirent de;
+  int fd, n;
+  struct direntx de[16], *d;
   struct stat st;
 
   if((fd = open(path, O_RDONLY)) < 0){
@@ -56,16 +56,13 @@ ls(char *path)
     strcpy(buf, path);
     p = buf+strlen(buf);
     *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        printf("ls: cannot stat %s\n", buf);
-        continue;
+    // getdents() supplies each entry's type and size, so
+    // there is no need to stat() it by name.
+    while((n = getdents(fd, de, sizeof(de))) > 0){
+      for(d = de; d < de + n/sizeof(*d); d++){
+        strcpy(p, d->name);
+        printf("%s %d %d %d\n", fmtname(buf), d->type, d->inum, d->size);
       }
-      printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
     }
     break;
   }
@@ -0,0 +1,41 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Print the kernel's statistics report (lock contention,
+// allocator and cache counters), or with arguments, hand
+// them to the kernel as a command, e.g. "stats disk poll".
+
+char buf[512];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, n;
+
+  if(argc > 1){
+    n = 0;
+    for(i = 1; i < argc && n + strlen(argv[i]) + 1 < sizeof(buf); i++){
+      if(i > 1)
+        buf[n++] = ' ';
+      strcpy(buf+n, argv[i]);
+      n += strlen(argv[i]);
+    }
+    if((fd = open("/statistics", O_WRONLY)) < 0 || write(fd, buf, n) != n){
+      fprintf(2, "stats: %s: failed\n", buf);
+      exit(1);
+    }
+    close(fd);
+    exit(0);
+  }
+
+  if((fd = open("/statistics", O_RDONLY)) < 0){
+    fprintf(2, "stats: cannot open /statistics\n");
+    exit(1);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(1, buf, n);
+  close(fd);
+  exit(0);
+}
@@ -1,4 +1,5 @@
 struct stat;
+struct direntx;
 
 // system calls
 int fork(void);
@@ -22,6 +23,11 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void *mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int fsync(int);
+int sync(void);
+int getdents(int, struct direntx*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -575,9 +575,11 @@ writetest(char *s)
   }
 }
 
+// a file that reaches into the doubly-indirect blocks.
 void
 writebig(char *s)
 {
+  enum { N = NDIRECT + NINDIRECT + NINDIRECT/2 };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -586,7 +588,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +608,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -629,6 +631,51 @@ writebig(char *s)
   }
 }
 
+// writes of several blocks, not aligned to blocks, that
+// cross from the singly- to the doubly-indirect blocks and
+// so must fit the per-transaction budget (MAXOPWRITE).
+void
+bigunaligned(char *s)
+{
+  enum { SZ = BUFSZ - 7, N = (NDIRECT + NINDIRECT + 8) * BSIZE / SZ + 1 };
+  int i, fd;
+
+  fd = open("bigunaligned", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i % 26, SZ);
+    if(write(fd, buf, SZ) != SZ){
+      printf("%s: write %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("bigunaligned", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, SZ) != SZ || buf[0] != 'a' + i % 26 || buf[SZ-1] != buf[0]){
+      printf("%s: chunk %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, 1) != 0){
+    printf("%s: file too long\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("bigunaligned") < 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -1778,6 +1825,64 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// Two files that grow a block at a time, in turn, end up in
+// many short runs of blocks. On a file system with extents
+// (make qemu-ext), that takes more than the NEXTENT in the
+// inode, so the rest go in the inode's extent block; the
+// files are then truncated and written again.
+void
+extents(char *s)
+{
+  enum { N = 3*NEXTENT };
+  char *names[] = { "extent0", "extent1" };
+  int fd[2], i, j, k;
+
+  for(k = 0; k < 2; k++){
+    for(j = 0; j < 2; j++){
+      fd[j] = open(names[j], O_CREATE|O_TRUNC|O_RDWR);
+      if(fd[j] < 0){
+        printf("%s: cannot create %s\n", s, names[j]);
+        exit(1);
+      }
+    }
+    // append to each in turn.
+    for(i = 0; i < N; i++){
+      for(j = 0; j < 2; j++){
+        memset(buf, 'a' + (i + j + k) % 26, BSIZE);
+        if(write(fd[j], buf, BSIZE) != BSIZE){
+          printf("%s: write %s block %d failed\n", s, names[j], i);
+          exit(1);
+        }
+      }
+    }
+    for(j = 0; j < 2; j++){
+      close(fd[j]);
+      if((fd[j] = open(names[j], O_RDONLY)) < 0){
+        printf("%s: cannot open %s\n", s, names[j]);
+        exit(1);
+      }
+      for(i = 0; i < N; i++){
+        if(read(fd[j], buf, BSIZE) != BSIZE ||
+           buf[0] != 'a' + (i + j + k) % 26 || buf[BSIZE-1] != buf[0]){
+          printf("%s: %s block %d wrong\n", s, names[j], i);
+          exit(1);
+        }
+      }
+      if(read(fd[j], buf, 1) != 0){
+        printf("%s: %s too long\n", s, names[j]);
+        exit(1);
+      }
+      close(fd[j]);
+    }
+  }
+  for(j = 0; j < 2; j++){
+    if(unlink(names[j]) != 0){
+      printf("%s: unlink %s failed\n", s, names[j]);
+      exit(1);
+    }
+  }
+}
+
 void
 fourteen(char *s)
 {
@@ -2571,6 +2676,590 @@ badarg(char *s)
   exit(0);
 }
 
+// fork shares pages copy-on-write. do parent and child
+// each see only their own writes, including writes the
+// kernel makes on their behalf?
+void
+cowfork(char *s)
+{
+  enum { N = 64 };
+  char *a;
+  int i, pid, xstatus, fds[2];
+
+  a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    a[i*PGSIZE] = i;
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // the kernel writes a shared page via copyout().
+    write(fds[1], "x", 1);
+    if(read(fds[0], a+1, 1) != 1 || a[1] != 'x')
+      exit(1);
+    for(i = 0; i < N; i++){
+      if(a[i*PGSIZE] != i)
+        exit(1);
+      a[i*PGSIZE] = -1;
+    }
+    exit(0);
+  }
+
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(a[i*PGSIZE] != i || a[1] != 0){
+      printf("%s: child's write leaked into parent\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// sbrk() grows lazily. can the kernel read and write heap
+// pages the program has never touched, and does shrinking
+// past untouched pages work?
+void
+lazysbrk(char *s)
+{
+  enum { N = 256 };
+  char *a, *b;
+  int fds[2];
+
+  a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  // copyin() from an untouched page sees zeroes.
+  b = a + (N/2)*PGSIZE;
+  if(write(fds[1], b, 1) != 1){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  // copyout() into another untouched page.
+  if(read(fds[0], a + (N-1)*PGSIZE + 7, 1) != 1 || a[(N-1)*PGSIZE + 7] != 0){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  a[3*PGSIZE] = 1;
+  if(sbrk(-(N*PGSIZE)) != a + N*PGSIZE){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// mmap() a file privately and shared, and some anonymous
+// memory. do shared writes, including a child's, reach the
+// file without growing it, and private ones not?
+void
+mmapfile(char *s)
+{
+  enum { N = 2*PGSIZE + 100 };
+  char *file = "mmapfile.tmp";
+  char *a;
+  int fd, i, pid, xstatus;
+
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, N) != N){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(a[i] != 'a' + i % 26){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  a[0] = 'Z';
+  if(munmap(a, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a' || a[N] != 0){
+    printf("%s: private write leaked or no zero fill\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[PGSIZE] = 'X';
+    a[N-1] = 'Y';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[PGSIZE] != 'X'){
+    printf("%s: child's write not shared\n", s);
+    exit(1);
+  }
+  // unmap the first page, then the rest, which writes it back.
+  if(munmap(a, PGSIZE) != 0 || munmap(a + PGSIZE, N - PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(file, O_RDONLY);
+  if(fd < 0 || read(fd, buf, BUFSZ) != N){
+    printf("%s: file size changed\n", s);
+    exit(1);
+  }
+  if(buf[0] != 'a' || buf[PGSIZE] != 'X' || buf[N-1] != 'Y'){
+    printf("%s: shared write not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+
+  a = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)0xffffffffffffffffL || a[0] != 0){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  a[PGSIZE] = 1;
+  if(munmap(a + PGSIZE, PGSIZE) != 0 || munmap(a, PGSIZE) != 0){
+    printf("%s: munmap anonymous failed\n", s);
+    exit(1);
+  }
+}
+
+// A child sees, and makes, changes to pages of a shared
+// mapping that neither process had touched before fork().
+void
+mmapfork(char *s)
+{
+  enum { N = 1024 };
+  char *a;
+  int pid, xstatus;
+
+  a = mmap(0, N*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[0] != 1 || a[(N/2)*PGSIZE] != 0)
+      exit(1);
+    a[(N/2)*PGSIZE] = 2;
+    a[(N-1)*PGSIZE] = 3;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[(N/2)*PGSIZE] != 2 || a[(N-1)*PGSIZE] != 3){
+    printf("%s: child's writes not shared\n", s);
+    exit(1);
+  }
+  if(munmap(a, N*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+}
+
+// Return the counter that precedes name in section of the
+// kernel's /statistics report, e.g. statcount("--- bcache",
+// "misses"), or -1 if there is no such counter.
+int
+statcount(char *section, char *name)
+{
+  static char rep[8192];
+  char tmp[512];
+  int fd, n, m, i, len;
+  char *p;
+
+  if((fd = open("/statistics", O_RDONLY)) < 0)
+    return -1;
+  // read to the end, which lets the next open start over.
+  n = 0;
+  while((m = read(fd, tmp, sizeof(tmp))) > 0){
+    if(m > sizeof(rep) - 1 - n)
+      m = sizeof(rep) - 1 - n;
+    memmove(rep + n, tmp, m);
+    n += m;
+  }
+  close(fd);
+  rep[n] = 0;
+
+  len = strlen(section);
+  for(p = rep; *p && memcmp(p, section, len) != 0; p++)
+    ;
+  len = strlen(name);
+  for(; *p && *p != '\n' && memcmp(p, name, len) != 0; p++)
+    ;
+  if(*p == 0 || *p == '\n')
+    return -1;
+  for(i = p - rep - 1; i > 0 && rep[i] == ' '; i--)
+    ;
+  while(i > 0 && rep[i-1] >= '0' && rep[i-1] <= '9')
+    i--;
+  return atoi(rep + i);
+}
+
+// A read that spans blocks reads them ahead, and gets the
+// same data as reads that don't: blocks it finds uncached
+// must be prefetched, not read one by one, and runs of
+// consecutive blocks must share disk requests.
+void
+readahead(char *s)
+{
+  char *file = "readahead.tmp";
+  int fd, i, n, b, tot, sum, miss, pf, req;
+  int nb = 128;  // several whole read-ahead windows
+  struct stat st;
+
+  miss = statcount("--- bcache", "misses");
+  pf = statcount("--- bcache", "prefetched");
+  req = statcount("--- disk", "requests");
+  if(miss < 0 || pf < 0 || req < 0){
+    printf("%s: no bcache counters in /statistics\n", s);
+    exit(1);
+  }
+  if((fd = open("usertests", O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  tot = sum = 0;
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    if(tot == 0 && (n < 4 || *(uint*)buf != 0x464C457FU)){
+      printf("%s: usertests read back without its ELF header\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n; i++)
+      sum += (uchar)buf[i];
+    tot += n;
+  }
+  close(fd);
+  if(n < 0 || tot != st.size){
+    printf("%s: read %d of %d bytes\n", s, tot, (int)st.size);
+    exit(1);
+  }
+  // again in small reads, from the cache this time.
+  fd = open("usertests", O_RDONLY);
+  while((n = read(fd, buf, 1000)) > 0){
+    for(i = 0; i < n; i++)
+      sum -= (uchar)buf[i];
+    tot -= n;
+  }
+  close(fd);
+  if(n < 0 || tot != 0 || sum != 0){
+    printf("%s: large and small reads got different data\n", s);
+    exit(1);
+  }
+  // a few misses may be index blocks, which are not prefetched.
+  if(statcount("--- bcache", "misses") - miss > 4 &&
+     statcount("--- bcache", "prefetched") == pf){
+    printf("%s: sequential read did not prefetch\n", s);
+    exit(1);
+  }
+  pf = statcount("--- bcache", "prefetched") - pf;
+  if(pf > 2*NVEC && statcount("--- disk", "requests") - req >= pf){
+    printf("%s: %d blocks prefetched one request each\n", s, pf);
+    exit(1);
+  }
+
+  // every block, past the read-ahead window, holds its own data.
+  unlink(file);
+  if((fd = open(file, O_CREATE|O_WRONLY)) < 0){
+    printf("%s: create %s failed\n", s, file);
+    exit(1);
+  }
+  for(b = 0; b < nb; b++){
+    memset(buf, b, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write %s failed\n", s, file);
+      exit(1);
+    }
+  }
+  close(fd);
+  fd = open(file, O_RDONLY);
+  tot = 0;
+  while((n = read(fd, buf, 3*BSIZE/2 + 7)) > 0){
+    for(i = 0; i < n; i++, tot++){
+      if((uchar)buf[i] != (uchar)(tot / BSIZE)){
+        printf("%s: byte %d of %s is %d\n", s, tot, file, (uchar)buf[i]);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  unlink(file);
+  if(n < 0 || tot != nb*BSIZE){
+    printf("%s: read %d bytes of %s\n", s, tot, file);
+    exit(1);
+  }
+}
+
+// The disk completion mode can be changed while running, by
+// a write to /statistics, and a file fsync'd in each mode
+// reads back intact.
+void
+diskmode(char *s)
+{
+  char *modes[] = { "poll", "hybrid", "interrupt" };
+  char cmd[32], section[32];
+  int fd, fd1, i, n;
+
+  if((fd = open("/statistics", O_WRONLY)) < 0){
+    printf("%s: open /statistics failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "disk bogus", 10) != -1){
+    printf("%s: set a bogus disk mode\n", s);
+    exit(1);
+  }
+  // end in interrupt, the default DISKMODE.
+  for(i = 0; i < sizeof(modes)/sizeof(modes[0]); i++){
+    strcpy(cmd, "disk ");
+    strcpy(cmd+5, modes[i]);
+    n = strlen(cmd);
+    if(write(fd, cmd, n) != n){
+      printf("%s: %s failed\n", s, cmd);
+      exit(1);
+    }
+    strcpy(section, "--- disk (");
+    strcpy(section+10, modes[i]);
+    strcpy(section+strlen(section), ")");
+    if(statcount(section, "requests") == -1){
+      printf("%s: %s not in effect\n", s, cmd);
+      exit(1);
+    }
+    fd1 = open("diskmode.tmp", O_CREATE|O_RDWR);
+    if(fd1 < 0 || write(fd1, cmd, n) != n || fsync(fd1) != 0){
+      printf("%s: write in %s mode failed\n", s, modes[i]);
+      exit(1);
+    }
+    close(fd1);
+    memset(buf, 0, n);
+    fd1 = open("diskmode.tmp", O_RDONLY);
+    if(fd1 < 0 || read(fd1, buf, sizeof(buf)) != n || memcmp(buf, cmd, n) != 0){
+      printf("%s: read back in %s mode failed\n", s, modes[i]);
+      exit(1);
+    }
+    close(fd1);
+    if(unlink("diskmode.tmp") != 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+// fsync() and sync() succeed on files, with the changes
+// readable and in the on-disk log when they return, and fail
+// on bad or non-file descriptors.
+void
+fsyncsync(char *s)
+{
+  char *file = "fsync.tmp";
+  int fd, fds[2], i, logged;
+
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  logged = statcount("--- log", "blocks logged");
+  for(i = 0; i < 2*BSIZE; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, 2*BSIZE) != 2*BSIZE || fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  if(statcount("--- log", "blocks logged") <= logged){
+    printf("%s: fsync wrote nothing to the log\n", s);
+    exit(1);
+  }
+  close(fd);
+  memset(buf, 0, 2*BSIZE);
+  fd = open(file, O_RDONLY);
+  if(fd < 0 || read(fd, buf, 2*BSIZE+1) != 2*BSIZE){
+    printf("%s: fsync'd %s did not read back\n", s, file);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < 2*BSIZE; i++){
+    if(buf[i] != 'a' + i % 26){
+      printf("%s: byte %d of fsync'd %s is wrong\n", s, i, file);
+      exit(1);
+    }
+  }
+  if(fsync(fd) != -1){
+    printf("%s: fsync of closed fd succeeded\n", s);
+    exit(1);
+  }
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  logged = statcount("--- log", "blocks logged");
+  if(unlink(file) != 0 || sync() != 0){
+    printf("%s: sync failed\n", s);
+    exit(1);
+  }
+  if(open(file, O_RDONLY) >= 0){
+    printf("%s: %s still there after unlink and sync\n", s, file);
+    exit(1);
+  }
+  if(statcount("--- log", "blocks logged") <= logged){
+    printf("%s: sync wrote nothing to the log\n", s);
+    exit(1);
+  }
+}
+
+// A running program's file cannot be opened for writing,
+// since its pages are read from the file as they are used.
+void
+textbusy(char *s)
+{
+  int fd;
+
+  if((fd = open("/usertests", O_RDWR)) >= 0){
+    printf("%s: opened running program for writing\n", s);
+    exit(1);
+  }
+  if(open("/usertests", O_WRONLY|O_TRUNC) >= 0){
+    printf("%s: truncated running program\n", s);
+    exit(1);
+  }
+  if((fd = open("/usertests", O_RDONLY)) < 0){
+    printf("%s: cannot read running program\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// getdents() of a directory big enough to be hashed returns
+// each entry once, with its type and size.
+void
+getdentstest(char *s)
+{
+  enum { N = 100 };
+  char name[8], seen[N];
+  struct direntx de[10], *d;
+  int fd, i, n, ndot = 0;
+
+  if(mkdir("gdd") != 0 || chdir("gdd") != 0){
+    printf("%s: mkdir gdd failed\n", s);
+    exit(1);
+  }
+  name[0] = 'f';
+  name[3] = 0;
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 10;
+    name[2] = '0' + i % 10;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0 || write(fd, buf, i) != i){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  memset(seen, 0, sizeof(seen));
+  if((fd = open(".", O_RDONLY)) < 0){
+    printf("%s: open . failed\n", s);
+    exit(1);
+  }
+  if(getdents(fd, de, sizeof(de[0]) - 1) != -1){
+    printf("%s: getdents with a short buffer did not fail\n", s);
+    exit(1);
+  }
+  while((n = getdents(fd, de, sizeof(de))) > 0){
+    for(d = de; d < de + n/sizeof(*d); d++){
+      if(strcmp(d->name, ".") == 0 || strcmp(d->name, "..") == 0){
+        if(d->type != T_DIR){
+          printf("%s: %s not a directory\n", s, d->name);
+          exit(1);
+        }
+        ndot++;
+        continue;
+      }
+      i = (d->name[1] - '0') * 10 + (d->name[2] - '0');
+      if(d->name[0] != 'f' || i < 0 || i >= N || seen[i]++ ||
+         d->type != T_FILE || d->size != i){
+        printf("%s: bad entry %s\n", s, d->name);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  if(n < 0 || ndot != 2){
+    printf("%s: getdents failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(seen[i] != 1){
+      printf("%s: entry %d missing\n", s, i);
+      exit(1);
+    }
+    name[1] = '0' + i / 10;
+    name[2] = '0' + i % 10;
+    unlink(name);
+  }
+  if(getdents(fd, de, sizeof(de)) != -1){
+    printf("%s: getdents of closed fd succeeded\n", s);
+    exit(1);
+  }
+  chdir("..");
+  if(unlink("gdd") != 0){
+    printf("%s: unlink gdd failed\n", s);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2590,6 +3279,7 @@ struct test {
   {opentest, "opentest"},
   {writetest, "writetest"},
   {writebig, "writebig"},
+  {bigunaligned, "bigunaligned"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
@@ -2613,6 +3303,7 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {extents, "extents"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
@@ -2635,6 +3326,15 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {cowfork, "cowfork" },
+  {lazysbrk, "lazysbrk" },
+  {mmapfile, "mmapfile" },
+  {mmapfork, "mmapfork" },
+  {readahead, "readahead" },
+  {diskmode, "diskmode" },
+  {fsyncsync, "fsyncsync" },
+  {getdentstest, "getdents" },
+  {textbusy, "textbusy" },
 
   { 0, 0},
 };
@@ -2985,12 +3685,19 @@ runtests(struct test *tests, char *justone, int continuous) {
 // touches the pages to force allocation.
 // because out of memory with lazy allocation results in the process
 // taking a fault and being killed, fork and report back.
+// exec() pages programs in on demand, so first touch all of
+// this program: pages of it that the caller happens to load
+// between two counts are not lost.
 //
 int
 countfree()
 {
+  extern char end[];
   int fds[2];
 
+  for(uint64 va = 0; va < (uint64)end; va += PGSIZE)
+    (void)*(volatile char *)(va + PGSIZE - 1);
+
   if(pipe(fds) < 0){
     printf("pipe() failed in countfree()\n");
     exit(1);
@@ -3095,6 +3802,7 @@ main(int argc, char *argv[])
     printf("Usage: usertests [-c] [-C] [-q] [testname]\n");
     exit(1);
   }
+
   if (drivetests(quick, continuous, justone)) {
     exit(1);
   }